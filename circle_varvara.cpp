@@ -214,25 +214,93 @@ u8 CircleDatetime::datetime_byte(u8 port) {
   }
 }
 
-void CircleVarvara::game_pad_input(const TGamePadState* state) {
-  if (state->buttons & TGamePadButton::GamePadButtonGuide) {
-    reset(false);
-    return;
+bool CircleRecording::open(const char* path) {
+  opened = f_open(&fil, path, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK;
+  if (!opened) logger.Write("Record", LogWarning, "Cannot write %s", path);
+  return opened;
+}
+
+// Audio vectors run in the sound interrupt, so their events can come in
+// the middle of another's.
+void CircleRecording::write(const void* data, u32 length) {
+  EnterCritical();
+  if (used + length > sizeof(pending)) overflowed = true;
+  else {
+    memcpy(pending + used, data, length);
+    used += length;
   }
+  LeaveCritical();
+}
 
-  // just skip input methods completely,
-  // and write directly to the device buffer
-  dev[0x82] =
-    (state->buttons & (TGamePadButton::GamePadButtonA | TGamePadButton::GamePadButtonX) ? 0x1 : 0) |
-    (state->buttons & (TGamePadButton::GamePadButtonB | TGamePadButton::GamePadButtonY) ? 0x2 : 0) |
-    (state->buttons & (TGamePadButton::GamePadButtonSelect | TGamePadButton::GamePadButtonMinus) ? 0x4 : 0) |
-    (state->buttons & (TGamePadButton::GamePadButtonStart | TGamePadButton::GamePadButtonPlus) ? 0x8 : 0) |
-    (state->buttons & TGamePadButton::GamePadButtonUp ? 0x10 : 0) |
-    (state->buttons & TGamePadButton::GamePadButtonDown ? 0x20 : 0) |
-    (state->buttons & TGamePadButton::GamePadButtonLeft ? 0x40 : 0) |
-    (state->buttons & TGamePadButton::GamePadButtonRight ? 0x80 : 0);
-  call_vec(0x80);
-  console.flush();
+void CircleRecording::flush() {
+  if (!opened) return;
+  EnterCritical();
+  u32 length = used;
+  memcpy(writing, pending, length);
+  used = 0;
+  bool lost = overflowed;
+  overflowed = false;
+  LeaveCritical();
+  unsigned written;
+  if (lost) logger.Write("Record", LogWarning, "Events came faster than they could be written; the recording won't replay");
+  if (length && (f_write(&fil, writing, length, &written) != FR_OK || written != length || f_sync(&fil) != FR_OK)) {
+    logger.Write("Record", LogWarning, "Write failed, recording stopped");
+    f_close(&fil);
+    opened = false;
+  }
+}
+
+// Logs the trace (see trace_start) a line at a time.
+void CircleVarvara::on_trace(TraceReason why) {
+  struct Log : TraceOutput {
+    CLogger& logger;
+    Log(CLogger& logger) : logger(logger) {}
+    void line(const char* text) final { logger.Write("Trace", LogNotice, "%s", text); }
+  } out(logger);
+  logger.Write("Trace", LogNotice, "Trace (%s):", trace_reason_name(why));
+  trace_dump(out);
+}
+
+bool CircleVarvara::record_to(const char* filename) {
+  if (!recording.open(filename)) return false;
+  record(&recording);
+  return true;
+}
+
+void CircleVarvara::game_pad_input(const TGamePadState* state) {
+  EnterCritical();
+  if (pad_count < PAD_STATES) pad_states[pad_count++] = state->buttons;
+  LeaveCritical();
+}
+
+void CircleVarvara::pass_game_pad_input() {
+  u32 states[PAD_STATES], count;
+  EnterCritical();
+  count = pad_count;
+  memcpy(states, pad_states, count * sizeof(u32));
+  pad_count = 0;
+  LeaveCritical();
+  for (u32 i = 0; i < count; i++) {
+    u32 buttons = states[i];
+    if (buttons & TGamePadButton::GamePadButtonGuide) {
+      reset(false);
+      continue;
+    }
+
+    // just skip input methods completely,
+    // and write directly to the device buffer
+    dev[0x82] =
+      (buttons & (TGamePadButton::GamePadButtonA | TGamePadButton::GamePadButtonX) ? 0x1 : 0) |
+      (buttons & (TGamePadButton::GamePadButtonB | TGamePadButton::GamePadButtonY) ? 0x2 : 0) |
+      (buttons & (TGamePadButton::GamePadButtonSelect | TGamePadButton::GamePadButtonMinus) ? 0x4 : 0) |
+      (buttons & (TGamePadButton::GamePadButtonStart | TGamePadButton::GamePadButtonPlus) ? 0x8 : 0) |
+      (buttons & TGamePadButton::GamePadButtonUp ? 0x10 : 0) |
+      (buttons & TGamePadButton::GamePadButtonDown ? 0x20 : 0) |
+      (buttons & TGamePadButton::GamePadButtonLeft ? 0x40 : 0) |
+      (buttons & TGamePadButton::GamePadButtonRight ? 0x80 : 0);
+    call_vec(0x80);
+  }
+  if (count) console.flush();
 }
 
 ShutdownMode CircleVarvara::run(SafeShutdown* safe_shutdown) {
@@ -241,20 +309,32 @@ ShutdownMode CircleVarvara::run(SafeShutdown* safe_shutdown) {
     m = safe_shutdown->shutdown_mode();
     if (m != ShutdownMode::None) return m;
   }
-  eval(PAGE_PROGRAM);
+  // Vectors give up the CPU at the end of each frame, and carry on in the
+  // next one. Input that comes in meanwhile is queued and runs once the
+  // vector finishes; the screen skips the frames it was busy for.
+  if (!vector_budget) vector_budget = ~0u;
+  u64 current_ticks = timer.GetClockTicks64();
+  exec_deadline = current_ticks + 16666;
+  eval_for(PAGE_PROGRAM, vector_budget);
   screen.repaint();
   console.flush();
-  u64 current_ticks = timer.GetClockTicks64();
+  recording.flush();
+  current_ticks = timer.GetClockTicks64();
   while (true) {
     if (safe_shutdown) {
       m = safe_shutdown->shutdown_mode();
       if (m != ShutdownMode::None) return m;
     }
+    exec_deadline = current_ticks + 16666;
+    if (suspended()) resume(vector_budget);
+    pass_game_pad_input();
     screen.frame();
     console.flush();
+    recording.flush();
 
-    // Sync at 60 Hz.
-    if ((timer.GetClockTicks64() - current_ticks) < 16666) {
+    // Sync at 60 Hz, unless a vector is still busy.
+    if (suspended()) overruns++;
+    else if ((timer.GetClockTicks64() - current_ticks) < 16666) {
       timer.usDelay(16666 - (timer.GetClockTicks64() - current_ticks));
     }
     current_ticks = timer.GetClockTicks64();
@@ -9,6 +9,8 @@
 #include <circle/timer.h>
 #include <circle/time.h>
 #include <circle/logger.h>
+#include <circle/synchronize.h>
+#include <circle/util.h>
 #include <circle/usb/usbhcidevice.h>
 #include <circle/usb/usbgamepad.h>
 #include <circle/sound/soundbasedevice.h>
@@ -52,26 +54,43 @@ protected:
   TScreenColor color_from_12bit(u8 r, u8 g, u8 b, u8 index) const final {
     return COLOR16(r*2, g*2, b*2);
   }
-  void on_paint() final {
-    if (offset_x || offset_y) gfx.ClearScreen(palette[0]);
-    if (zoom <= 1) {
-      gfx.DrawImage(offset_x, offset_y, w, h, const_cast<TScreenColor*>(pixels));
+  // The display is double-buffered, so each buffer also gets what changed
+  // in the frame before, which went to the other one.
+  void on_paint(const Rect* rects, u32 count) final {
+    bool full = count == 1 && rects[0].w == w && rects[0].h == h;
+    if (full || last_full) {
+      if (offset_x || offset_y) gfx.ClearScreen(palette[0]);
+      draw({ 0, 0, w, h });
     } else {
-      auto max_w = gfx.GetWidth();
-      TScreenColor* buf = gfx.GetBuffer();
-      for (unsigned x = 0; x < w; x++) {
-        for (unsigned y = 0; y < h; y++) {
-          unsigned pixel_ix = y * w + x;
-          for (unsigned xx = offset_x + x * zoom; xx < offset_x + (x+1) * zoom; xx++) {
-            for (unsigned yy = offset_y + y * zoom; yy < offset_y + (y+1) * zoom; yy++) {
-              buf[yy * max_w + xx] = pixels[pixel_ix];
-            }
-          }
-        }
-      }
+      for (u32 i = 0; i < last_count; i++) draw(last[i]);
+      for (u32 i = 0; i < count; i++) draw(rects[i]);
     }
+    for (u32 i = 0; i < count; i++) last[i] = rects[i];
+    last_count = count, last_full = full;
     gfx.UpdateDisplay();
   }
+
+private:
+  Rect last[MAX_RECTS];
+  u32 last_count = 0;
+  bool last_full = true;
+
+  void draw(const Rect& r) {
+    if (zoom <= 1) {
+      if (r.x == 0 && r.w == w) {
+        gfx.DrawImage(offset_x, offset_y + r.y, w, r.h, const_cast<TScreenColor*>(pixels + r.y * w));
+        return;
+      }
+      for (unsigned y = r.y; y < r.y + r.h; y++)
+        gfx.DrawImage(offset_x + r.x, offset_y + y, r.w, 1, const_cast<TScreenColor*>(pixels + y * w + r.x));
+    } else {
+      unsigned max_w = gfx.GetWidth();
+      TScreenColor* buf = gfx.GetBuffer() + (offset_y + r.y * zoom) * max_w + offset_x + r.x * zoom;
+      scale_rect<sizeof(TScreenColor)>(reinterpret_cast<u8*>(buf), max_w * sizeof(TScreenColor),
+                                       reinterpret_cast<const u8*>(pixels + r.y * w + r.x), w * sizeof(TScreenColor),
+                                       r.w, r.h, zoom);
+    }
+  }
 };
 
 class CircleAudio : public Audio {
@@ -143,6 +162,23 @@ public:
   u8 datetime_byte(u8 port) final;
 };
 
+// Writes a recording (see Event) to the SD card. Game pad input arrives
+// in its interrupt handler, so events are buffered and only written out by
+// flush, from the run loop.
+class CircleRecording : public StateWriter {
+  CLogger& logger;
+  FIL fil;
+  bool opened = false, overflowed = false;
+  u8 pending[0x4000], writing[0x4000];
+  u32 used = 0;
+public:
+  CircleRecording(CLogger& logger) : logger(logger) {}
+  ~CircleRecording() { if (opened) f_close(&fil); }
+  bool open(const char* path);
+  void write(const void* data, u32 length) final;
+  void flush();
+};
+
 class CircleVarvara : public Varvara {
   CircleConsole console;
   CircleScreen screen;
@@ -150,8 +186,22 @@ class CircleVarvara : public Varvara {
   Input input;
   CircleFilesystem file;
   CircleDatetime datetime;
+  CircleRecording recording;
+  CLogger& logger;
   C2DGraphics& gfx;
   CTimer& timer;
+  u64 exec_deadline = 0;
+  // Game pad buttons from the USB interrupt that run hasn't passed on to
+  // the ROM yet, oldest first.
+  static constexpr u32 PAD_STATES = 16;
+  u32 pad_states[PAD_STATES];
+  u32 pad_count = 0;
+  bool past_deadline() final { return timer.GetClockTicks64() >= exec_deadline; }
+  void hle_mismatch(const Hook& hook, u16 addr) final {
+    logger.Write("HLE", LogWarning, "%s at %04x doesn't match the ROM code, not hooking it", hook.name, addr);
+  }
+  void on_trace(TraceReason why) final;
+  void pass_game_pad_input();
 public:
   CircleVarvara(
     C2DGraphics& gfx,
@@ -166,11 +216,21 @@ public:
       input(*this),
       file(*this, fs, logger),
       datetime(t),
+      recording(logger),
       Varvara(&console, &screen, &audio, &input, &file, &datetime, rom_filename),
+      logger(logger),
       gfx(gfx),
       timer(t) {}
 
+  // Frames in which a vector ran out of time and was suspended.
+  u32 overruns = 0;
+
+  // Called from the USB interrupt, so it only notes the buttons: run
+  // passes them on, between vectors.
   void game_pad_input(const TGamePadState* state);
+  // Records the session from here on to `filename` on the SD card, for
+  // uxn_replay. Call it between init and run.
+  bool record_to(const char* filename);
   ShutdownMode run(SafeShutdown* safe_shutdown = nullptr);
 };
 
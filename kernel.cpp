@@ -118,9 +118,22 @@ no_gamepad:;
   // Enter the uxn interpreter
   auto shutdown_mode = ShutdownMode::Halt;
   varvara = new uxn::CircleVarvara(gfx, nullptr, timer, logger, fs, FILENAME);
+  varvara->engine = uxn::Engine::Aot;
+  // hle=on in cmdline.txt runs library routines natively where they're
+  // recognised; hle=verify also runs the ROM code and logs the hooks that
+  // disagree with it.
+  const char* hle = options.GetAppOptionString("hle");
+  if (hle && !strcmp(hle, "on")) varvara->hle = uxn::Hle::On;
+  else if (hle && !strcmp(hle, "verify")) varvara->hle = uxn::Hle::Verify;
+  // trace=<N> in cmdline.txt logs the last N jumps and device writes on
+  // halt, stack wrap-around or System/debug.
+  varvara->trace_start(options.GetAppOptionDecimal("trace", 0));
   if (!varvara->init()) {
     logger.Write(FromKernel, LogPanic, "Varvara init failed");
   } else {
+    // record=<file> in cmdline.txt records the session, for uxn_replay.
+    const char* record = options.GetAppOptionString("record");
+    if (record) varvara->record_to(record);
     shutdown_mode = varvara->run(/*&safe_shutdown*/);
   }
 
@@ -0,0 +1,315 @@
+#include "uxn_aot.hpp"
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// uxn_aot: compiles a ROM to C++ for Engine::Aot.
+//
+//   uxn_aot <rom> <name> <out.cpp>
+//
+// Starting from the reset vector, follows every control transfer whose
+// target can be read off the code itself: JCI/JMI/JSI, JMP/JCN/JSR right
+// after a LIT of the same size and stack, both ways out of a comparison
+// followed by JMP, and the entries of a table read by LDA2 right before
+// JMP2/JSR2. LIT2 addresses written to a device vector port are entry
+// points too. Nothing else is decoded, so data is rarely mistaken for
+// code; an address found at run time that wasn't decoded is interpreted
+// instead.
+//
+// Routines (the reset vector, call targets and vectors) each become a
+// region, together with everything they reach through static jumps, and
+// every region is one C++ function. A static target is only a guess: the
+// generated code compares the pc the instruction actually computed against
+// it before taking the goto, so literals patched at run time stay correct.
+//
+// The output links into any target that has uxn_aot.hpp on its include
+// path, and registers itself for the ROM it was compiled from.
+
+using namespace uxn;
+
+namespace {
+
+constexpr u32 NONE = ~0u;
+
+constexpr u8 op_length(u8 ins) {
+  return (ins & 0x1f) || !ins ? 1 : (ins & 0x80) && !(ins & 0x20) ? 2 : 3;
+}
+
+// BRK, JCI, JMI, JSI, JMP, JCN and JSR.
+constexpr bool is_control(u8 ins) {
+  u8 op = ins & 0x1f;
+  return op ? op >= 0x0c && op <= 0x0e : !(ins & 0x80);
+}
+
+// Control transfers that may continue with the next instruction.
+constexpr bool falls_through(u8 ins) {
+  u8 op = ins & 0x1f;
+  return !is_control(ins) || ins == 0x20 || ins == 0x60 || op == 0x0d || op == 0x0e;
+}
+
+constexpr bool is_call(u8 ins) {
+  return ins == 0x60 || (ins & 0x1f) == 0x0e;
+}
+
+// EQU, NEQ, GTH or LTH, leaving its result where `jump` reads it.
+constexpr bool is_comparison(u8 ins, u8 jump) {
+  u8 op = ins & 0x1f;
+  return op >= 0x08 && op <= 0x0b && (ins & 0x40) == (jump & 0x40);
+}
+
+// Stores and device calls, after which the code may have been overwritten.
+constexpr bool may_write(u8 ins) {
+  u8 op = ins & 0x1f;
+  return op == 0x11 || op == 0x13 || op == 0x15 || op == 0x16 || op == 0x17;
+}
+
+struct Node {
+  bool decoded = false, label = false;
+  u8 ins = 0;
+  s32 prev = -1;           // instruction decoded right before this one
+  std::vector<u16> jumps;  // static targets other than calls
+  s32 call = -1;           // static call target
+  u32 region = NONE;
+};
+
+class Compiler {
+public:
+  u8 ram[0x10003] = {0}; // room to read operands past the end
+  u32 rom_end;
+  Node nodes[0x10000];
+  std::vector<u16> entries;
+  std::vector<std::vector<u16>> regions; // addresses of each region, sorted
+  u32 instructions = 0;
+
+  Compiler(const std::vector<u8>& rom) {
+    rom_end = PAGE_PROGRAM + rom.size() < 0x10000 ? PAGE_PROGRAM + rom.size() : 0x10000;
+    for (u32 i = PAGE_PROGRAM; i < rom_end; i++) ram[i] = rom[i - PAGE_PROGRAM];
+  }
+
+  void discover() {
+    add_entry(PAGE_PROGRAM);
+    while (!work.empty()) {
+      u16 a = work.back();
+      work.pop_back();
+      visit(a);
+    }
+  }
+
+  void form_regions() {
+    for (u16 e : entries) {
+      if (nodes[e].region != NONE) continue;
+      u32 r = regions.size();
+      regions.emplace_back();
+      std::vector<u16> stack = { e };
+      while (!stack.empty()) {
+        u16 a = stack.back();
+        stack.pop_back();
+        Node& n = nodes[a];
+        if (!n.decoded || n.region != NONE) continue;
+        n.region = r;
+        regions[r].push_back(a);
+        for (u16 t : n.jumps) stack.push_back(t);
+        if (falls_through(n.ins)) stack.push_back(next(a));
+      }
+      std::sort(regions[r].begin(), regions[r].end());
+    }
+    // Anything jumped to from elsewhere needs a label, and so does code
+    // that doesn't directly follow its predecessor in the output.
+    for (auto& region : regions) {
+      for (size_t i = 0; i < region.size(); i++) {
+        u16 a = region[i];
+        Node& n = nodes[a];
+        instructions++;
+        for (u16 t : n.jumps) mark_label(t);
+        if (n.call >= 0) mark_label(n.call);
+        if (!falls_through(n.ins)) continue;
+        u16 f = next(a);
+        if (is_control(n.ins) || i + 1 == region.size() || region[i + 1] != f) mark_label(f);
+      }
+    }
+    for (u16 e : entries) mark_label(e);
+  }
+
+  void emit(FILE* out, const char* rom_name, const char* name, u64 hash, u32 size) {
+    fprintf(out, "// Generated by uxn_aot from %s: %u instructions in %zu regions.\n", rom_name, instructions, regions.size());
+    fprintf(out, "// Do not edit.\n\n#include \"uxn_aot.hpp\"\n\nnamespace uxn {\n\nnamespace {\n\n");
+    fprintf(out, "const u8 opcodes[0x2000] = {");
+    for (u32 i = 0; i < 0x2000; i++) {
+      u8 b = 0;
+      for (u32 j = 0; j < 8; j++) if (nodes[i * 8 + j].region != NONE) b |= 1 << j;
+      fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n  ", b);
+    }
+    fprintf(out, "\n};\n");
+    for (u32 r = 0; r < regions.size(); r++) emit_region(out, r);
+    fprintf(out, "\nu32 run(Uxn& u, AotRegs& c) {\n  switch (c.pc) {\n");
+    for (u32 r = 0; r < regions.size(); r++) {
+      for (u16 a : regions[r]) if (nodes[a].label) fprintf(out, "    case 0x%04x:\n", a);
+      fprintf(out, "      return r_%04x(u, c);\n", regions[r][0]);
+    }
+    fprintf(out, "  }\n  return c.pc | AOT_MISS;\n}\n\n}\n\n");
+    fprintf(out, "extern const AotRom aot_%s;\n", name);
+    fprintf(out, "const AotRom aot_%s(\"%s\", 0x%016llxull, %u, opcodes, run);\n\n}\n", name, name, static_cast<unsigned long long>(hash), size);
+  }
+
+private:
+  std::vector<u16> work;
+
+  u16 next(u16 a) const { return a + op_length(nodes[a].ins); }
+  u16 peek(u32 a) const { return ram[a] << 8 | ram[a + 1]; }
+  bool in_rom(u32 a) const { return a >= PAGE_PROGRAM && a < rom_end; }
+  void mark_label(u16 a) { if (nodes[a].region != NONE) nodes[a].label = true; }
+
+  void add_entry(u16 a) {
+    if (!in_rom(a)) return;
+    for (u16 e : entries) if (e == a) return;
+    entries.push_back(a);
+    work.push_back(a);
+  }
+  void add_jump(Node& n, u16 a) {
+    if (!in_rom(a)) return;
+    for (u16 t : n.jumps) if (t == a) return;
+    n.jumps.push_back(a);
+    work.push_back(a);
+  }
+
+  // Decodes the instruction at `a`, or works out its targets again now
+  // that more is known about the instruction before it.
+  void visit(u16 a) {
+    Node& n = nodes[a];
+    n.decoded = true;
+    n.ins = ram[a];
+    u16 f = a + op_length(n.ins);
+    u16 imm = peek(a + 1);
+    u8 op = n.ins & 0x1f;
+    s32 target = -1;
+    if (n.ins == 0x20 || n.ins == 0x40 || n.ins == 0x60) {
+      target = static_cast<u16>(f + imm);
+    } else if (op >= 0x0c && op <= 0x0e && n.prev >= 0) {
+      // A literal of the right size, pushed to the stack the jump reads.
+      u8 lit = (n.ins & 0x20 ? 0xa0 : 0x80) | (n.ins & 0x40);
+      u16 p = n.prev;
+      if (ram[p] == lit) {
+        target = n.ins & 0x20 ? peek(p + 1) : static_cast<u16>(f + static_cast<s8>(ram[p + 1]));
+      }
+    }
+    if (target >= 0) {
+      if (is_call(n.ins)) n.call = target, add_entry(target);
+      else add_jump(n, target);
+    } else if ((n.ins & 0xbf) == 0x0c && n.prev >= 0 && is_comparison(ram[n.prev], n.ins)) {
+      // EQU JMP and friends skip the next byte or not.
+      add_jump(n, f), add_jump(n, f + 1);
+    } else if ((n.ins & 0xfd) == 0x2c && n.prev >= 0 && ram[n.prev] == 0x34) {
+      // ;table ... ADD2 LDA2 JMP2 or JSR2: every entry of the table, up to
+      // the first word that doesn't point into the ROM.
+      s32 p = nodes[n.prev].prev;
+      for (int i = 0; i < 8 && p >= 0 && !(ram[p] == 0xa0 && in_rom(peek(p + 1))); i++) p = nodes[p].prev;
+      for (u32 t = p >= 0 ? peek(p + 1) : 0; t && in_rom(peek(t)) && t < rom_end; t += 2) {
+        if (is_call(n.ins)) add_entry(peek(t));
+        else add_jump(n, peek(t));
+      }
+    }
+    // ;vector .Device/vector DEO2
+    if (n.ins == 0xa0 && ram[f] == 0x80 && ram[f + 2] == 0x37 && (ram[f + 1] & 0x0f) == 0) {
+      add_entry(imm);
+    }
+    if (falls_through(n.ins) && in_rom(f) && nodes[f].prev < 0) {
+      nodes[f].prev = a;
+      work.push_back(f);
+    }
+  }
+
+  void emit_region(FILE* out, u32 r) {
+    const std::vector<u16>& region = regions[r];
+    fprintf(out, "\nu32 r_%04x(Uxn& u, AotRegs& regs) {\n  AotRegs c = regs;\n  u32 next;\n  switch (c.pc) {\n", region[0]);
+    for (u16 a : region) if (nodes[a].label) fprintf(out, "    case 0x%04x: goto L_%04x;\n", a, a);
+    fprintf(out, "  }\n  next = c.pc | AOT_MISS;\n  goto out;\n");
+    // Instructions of the current segment charged but not yet run.
+    u32 unrun = 0;
+    for (size_t i = 0; i < region.size(); i++) {
+      u16 a = region[i];
+      const Node& n = nodes[a];
+      u16 f = next(a);
+      if (n.label) fprintf(out, "L_%04x:\n", a);
+      if (starts_segment(region, i)) {
+        u32 length = 1;
+        while (i + length < region.size() && !starts_segment(region, i + length)) length++;
+        fprintf(out, "  if (c.left < %u) { next = 0x%04x | AOT_STOP; goto out; }\n  c.left -= %u;\n", length, a, length);
+        unrun = length;
+      }
+      unrun--;
+      if (!n.ins) {
+        fprintf(out, "  next = AOT_BRK; goto out;\n");
+        continue;
+      }
+      fprintf(out, "  c.pc = 0x%04x; aot::step<0x%02x>(u, c);\n", static_cast<u16>(a + 1), n.ins);
+      // A write that discarded the code gives back the rest of the segment.
+      if (may_write(n.ins) && unrun)
+        fprintf(out, "  if (!u.aot_valid) { c.left += %u; next = 0x%04x; goto out; }\n", unrun, f);
+      else if (may_write(n.ins))
+        fprintf(out, "  if (!u.aot_valid) { next = 0x%04x; goto out; }\n", f);
+      if (is_control(n.ins)) {
+        std::vector<u16> targets = n.jumps;
+        if (n.call >= 0) targets.push_back(n.call);
+        if (falls_through(n.ins)) targets.push_back(f);
+        for (u16 t : targets) {
+          if (nodes[t].region == r) fprintf(out, "  if (c.pc == 0x%04x) goto L_%04x;\n", t, t);
+        }
+        fprintf(out, "  next = c.pc; goto out;\n");
+      } else if (i + 1 == region.size() || region[i + 1] != f) {
+        if (nodes[f].region == r) fprintf(out, "  goto L_%04x;\n", f);
+        else fprintf(out, "  next = 0x%04x; goto out;\n", f);
+      }
+    }
+    fprintf(out, "out:\n  regs = c;\n  return next;\n}\n");
+  }
+
+  bool starts_segment(const std::vector<u16>& region, size_t i) const {
+    if (!i || nodes[region[i]].label) return true;
+    u16 p = region[i - 1];
+    return is_control(nodes[p].ins) || next(p) != region[i];
+  }
+};
+
+std::string identifier(const char* name) {
+  std::string id;
+  for (const char* c = name; *c; c++) {
+    bool alnum = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9');
+    id += alnum ? *c : '_';
+  }
+  if (id.empty() || (id[0] >= '0' && id[0] <= '9')) id = "_" + id;
+  return id;
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <rom> <name> <out.cpp>\n", argv[0]);
+    return 1;
+  }
+  FILE* in = fopen(argv[1], "rb");
+  if (!in) {
+    fprintf(stderr, "uxn_aot: cannot open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<u8> rom;
+  u8 buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), in)) > 0;) rom.insert(rom.end(), buf, buf + n);
+  fclose(in);
+
+  auto compiler = new Compiler(rom);
+  compiler->discover();
+  compiler->form_regions();
+  FILE* out = fopen(argv[3], "w");
+  if (!out) {
+    fprintf(stderr, "uxn_aot: cannot write %s\n", argv[3]);
+    return 1;
+  }
+  const char* rom_name = argv[1];
+  for (const char* c = argv[1]; *c; c++) if (*c == '/' || *c == '\\') rom_name = c + 1;
+  compiler->emit(out, rom_name, identifier(argv[2]).c_str(), aot_hash(rom.data(), rom.size()), rom.size());
+  fclose(out);
+  delete compiler;
+  return 0;
+}
@@ -0,0 +1,62 @@
+#include "banded_screen.hpp"
+
+namespace uxn {
+
+BandCompositor::BandCompositor(u32 threads) {
+  for (u32 i = 1; i < threads; i++) workers.emplace_back(&BandCompositor::work, this);
+}
+
+BandCompositor::~BandCompositor() {
+  {
+    std::lock_guard<std::mutex> l(lock);
+    stopping = true;
+  }
+  work_ready.notify_all();
+  for (std::thread& t : workers) t.join();
+}
+
+/* A worker that wakes after the job is over finds it gone and goes back
+   to sleep. The job isn't cleared until every worker that took it up has
+   put it down, so none can carry on into the next. */
+void BandCompositor::run(u32 bands, const std::function<void(u32)>& band) {
+  std::lock_guard<std::mutex> t(turn);
+  {
+    std::lock_guard<std::mutex> l(lock);
+    job = &band, job_bands = bands;
+    next = 0, pending = bands;
+    generation++;
+  }
+  work_ready.notify_all();
+  take_bands();
+  std::unique_lock<std::mutex> l(lock);
+  work_done.wait(l, [&] { return !pending && !active; });
+  job = nullptr;
+}
+
+void BandCompositor::take_bands() {
+  for (u32 i; (i = next++) < job_bands;) {
+    (*job)(i);
+    if (--pending == 0) {
+      std::lock_guard<std::mutex> l(lock);
+      work_done.notify_all();
+    }
+  }
+}
+
+void BandCompositor::work() {
+  u64 seen = 0;
+  std::unique_lock<std::mutex> l(lock);
+  for (;;) {
+    work_ready.wait(l, [&] { return stopping || generation != seen; });
+    if (stopping) return;
+    seen = generation;
+    if (!job) continue;
+    active++;
+    l.unlock();
+    take_bands();
+    l.lock();
+    if (!--active && !pending) work_done.notify_all();
+  }
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "varvara.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace uxn {
+
+// Worker threads that split a job into bands and run them together, with
+// the calling thread as one of them. Any number of screens can share one;
+// their jobs take turns.
+class BandCompositor {
+public:
+  // Repaints of fewer pixels than this are composited on the calling
+  // thread alone: waking the workers would cost more than they'd save.
+  static constexpr u32 MIN_PIXELS = 1 << 18;
+
+  explicit BandCompositor(u32 threads = std::thread::hardware_concurrency());
+  ~BandCompositor();
+
+  u32 threads() const { return workers.size() + 1; }
+
+  // Calls `band` once for each of 0 to bands - 1, across the workers and
+  // the calling thread, and returns when all of them are done.
+  void run(u32 bands, const std::function<void(u32 band)>& band);
+
+private:
+  std::vector<std::thread> workers;
+  std::mutex turn, lock;
+  std::condition_variable work_ready, work_done;
+  const std::function<void(u32)>* job = nullptr;
+  u32 job_bands = 0, active = 0;
+  u64 generation = 0;
+  std::atomic<u32> next{0}, pending{0};
+  bool stopping = false;
+
+  void take_bands();
+  void work();
+};
+
+// A PixelScreen whose big repaints are composited by a BandCompositor, in
+// horizontal bands of the changed rows, one per thread. Each band covers
+// whole rows, so overlapping rectangles never have two threads writing
+// the same pixel.
+template <typename Pixel>
+class BandedScreen : public PixelScreen<Pixel> {
+public:
+  // Null to composite on the calling thread only.
+  BandCompositor* compositor = nullptr;
+
+protected:
+  using Rect = Screen::Rect;
+  BandedScreen(Uxn& uxn, u16 width, u16 height) : PixelScreen<Pixel>(uxn, width, height) {}
+
+  void compose(const Rect* rects, u32 count) override {
+    u32 area = 0, y1 = this->h, y2 = 0;
+    for (u32 i = 0; i < count; i++) {
+      area += rects[i].w * rects[i].h;
+      if (rects[i].y < y1) y1 = rects[i].y;
+      if (rects[i].y + rects[i].h > y2) y2 = rects[i].y + rects[i].h;
+    }
+    if (!compositor || compositor->threads() < 2 || area < BandCompositor::MIN_PIXELS) {
+      this->compose_rows(rects, count, 0, this->h);
+      return;
+    }
+    u32 bands = compositor->threads(), rows = y2 - y1;
+    compositor->run(bands, [&](u32 band) {
+      this->compose_rows(rects, count, y1 + rows * band / bands, y1 + rows * (band + 1) / bands);
+    });
+  }
+};
+
+}
@@ -0,0 +1,126 @@
+#include "headless_varvara.hpp"
+#include <fstream>
+#include <iterator>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+namespace uxn {
+
+u8 VirtualDatetime::datetime_byte(u8 port) {
+  time_t seconds = epoch + elapsed_us / 1000000;
+  struct tm t = {};
+  gmtime_r(&seconds, &t);
+  switch (port) {
+    case 0x0: return (t.tm_year + 1900) >> 8;
+    case 0x1: return (t.tm_year + 1900);
+    case 0x2: return t.tm_mon;
+    case 0x3: return t.tm_mday;
+    case 0x4: return t.tm_hour;
+    case 0x5: return t.tm_min;
+    case 0x6: return t.tm_sec;
+    case 0x7: return t.tm_wday;
+    case 0x8: return t.tm_yday >> 8;
+    case 0x9: return t.tm_yday;
+    case 0xa: return t.tm_isdst;
+    default: return 0;
+  }
+}
+
+bool HeadlessVarvara::init() {
+  if (!Varvara::init()) return false;
+  if (vector_budget) eval_for(PAGE_PROGRAM, vector_budget);
+  else eval(PAGE_PROGRAM);
+  screen.present();
+  return true;
+}
+
+bool HeadlessVarvara::step_frame() {
+  if (halted()) return false;
+  if (suspended()) {
+    resume(vector_budget);
+    screen.present();
+  } else
+    screen.frame();
+  datetime.advance(FRAME_US);
+  frame_count++;
+  return !halted();
+}
+
+void HeadlessVarvara::save_devices(StateWriter& out) {
+  Varvara::save_devices(out);
+  out.write(&datetime.elapsed_us, sizeof(datetime.elapsed_us));
+  out.write(&frame_count, sizeof(frame_count));
+}
+
+bool HeadlessVarvara::load_devices(StateReader& in) {
+  if (!Varvara::load_devices(in) || !in.read(&datetime.elapsed_us, sizeof(datetime.elapsed_us)) ||
+      !in.read(&frame_count, sizeof(frame_count)))
+    return false;
+  screen.present();
+  return true;
+}
+
+u32 HeadlessVarvara::step_frames(u32 count) {
+  u32 i;
+  for (i = 0; i < count && !halted(); i++) step_frame();
+  return i;
+}
+
+bool HeadlessVarvara::replay(const char* path) {
+  std::ifstream f(path, std::ios::binary);
+  std::vector<u8> log((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if (log.size() < Event::HEADER_SIZE || memcmp(log.data(), "UXNREC2\n", 8)) return false;
+  std::vector<Event> events;
+  for (u32 at = Event::HEADER_SIZE, used; at < log.size(); at += used) {
+    Event e;
+    used = Event::decode(log.data() + at, log.size() - at, e);
+    if (!used) return false;
+    events.push_back(e);
+  }
+
+  hle = static_cast<Hle>(log[12]);
+  recorded_on = static_cast<Engine>(log[13]);
+  if (!Varvara::init()) return false;
+  screen.try_resize(peek2(log.data() + 8), peek2(log.data() + 10));
+  replaying = true, in_sync = true;
+  // The Reads just before a Run are its DEIs'.
+  const Event* reads = events.data();
+  for (const Event& e : events) {
+    for (; frame_count < e.frame; frame_count++) {
+      screen.present();
+      datetime.advance(FRAME_US);
+    }
+    switch (e.type) {
+      case Event::Ports: memcpy(dev + e.port, e.data, 16); break;
+      case Event::Read: continue;
+      case Event::Reset: reset(e.port); break;
+      case Event::Run: {
+        bool finished = e.data[0];
+        u64 before = counters.instructions;
+        next_read = reads, reads_end = &e;
+        eval_for(e.pc, finished ? ~0u : e.count);
+        // Reads left over mean a DEI didn't happen.
+        if (next_read != reads_end || counters.instructions - before != e.count || suspended() == finished)
+          in_sync = false;
+        break;
+      }
+    }
+    reads = &e + 1;
+    if (!in_sync) break;
+  }
+  screen.present();
+  replaying = false;
+  return in_sync;
+}
+
+void HeadlessVarvara::before_dei(u8 d) {
+  if (!replaying || !reads_host(d)) return Varvara::before_dei(d);
+  if (next_read == reads_end || next_read->port != d) {
+    in_sync = false;
+    return;
+  }
+  dev[d] = next_read++->data[0];
+}
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include "banded_screen.hpp"
+#include "stdlib_console.hpp"
+#include "stdlib_filesystem.hpp"
+
+namespace uxn {
+
+// Screen that only draws into `pixels`, as 0x00RRGGBB.
+class HeadlessScreen : public BandedScreen<u32> {
+public:
+  HeadlessScreen(Uxn& uxn, u16 w, u16 h) : BandedScreen(uxn, w, h) {}
+
+  u32 color_from_12bit(u8 r, u8 g, u8 b, u8 index) const final {
+    return (r * 0x11) << 16 | (g * 0x11) << 8 | (b * 0x11);
+  }
+  const u32* framebuffer() const { return pixels; }
+  // The rectangles of the last repaint. A caller that wants to know
+  // whether the next present() repaints anything sets the count to 0.
+  const Rect* last_paint = nullptr;
+  u32 last_paint_count = 0;
+
+protected:
+  void on_paint(const Rect* rects, u32 count) final { last_paint = rects, last_paint_count = count; }
+  void on_resize() final {}
+};
+
+// Datetime that reads a clock which only moves when told to, from `epoch`
+// (seconds since 1970, UTC).
+class VirtualDatetime : public Datetime {
+public:
+  u64 epoch;
+  u64 elapsed_us = 0;
+
+  VirtualDatetime(u64 epoch) : epoch(epoch) {}
+
+  void advance(u64 us) { elapsed_us += us; }
+  u8 datetime_byte(u8 port) final;
+};
+
+// Varvara with no window, sound or wall clock: it runs only when stepped,
+// and draws into a framebuffer in memory. Frames are 1/60 s of virtual
+// time, so a ROM given the same input does the same thing every run.
+class HeadlessVarvara : public Varvara {
+protected:
+  StdlibConsole console;
+  HeadlessScreen screen;
+  DummyAudio audio;
+  Input input;
+  StdlibFilesystem file;
+  VirtualDatetime datetime;
+
+public:
+  // 2024-01-01T00:00:00Z
+  static constexpr u64 DEFAULT_EPOCH = 1704067200;
+  static constexpr u64 FRAME_US = 1000000 / 60;
+
+  HeadlessVarvara(u16 w, u16 h, const char* root_dir, const u8* rom, u32 rom_size,
+                  std::ostream& out = std::cout, u64 epoch = DEFAULT_EPOCH)
+  : Varvara(&console, &screen, &audio, &input, &file, &datetime, rom, rom_size),
+    console(*this, out),
+    screen(*this, w, h),
+    audio(*this),
+    input(*this),
+    file(*this, root_dir),
+    datetime(epoch) {}
+
+  HeadlessVarvara(u16 w, u16 h, const char* root_dir, const char* rom_filename = "boot.rom",
+                  std::ostream& out = std::cout, u64 epoch = DEFAULT_EPOCH)
+  : Varvara(&console, &screen, &audio, &input, &file, &datetime, rom_filename),
+    console(*this, out),
+    screen(*this, w, h),
+    audio(*this),
+    input(*this),
+    file(*this, root_dir),
+    datetime(epoch) {}
+
+  virtual ~HeadlessVarvara() {}
+
+  // Loads the ROM and runs its reset vector.
+  virtual bool init();
+
+  // Runs one frame: the screen vector (or what's left of a vector cut short
+  // by vector_budget), then the repaint, then the clock moves on a frame.
+  // Returns false once the ROM has halted.
+  bool step_frame();
+  u32 step_frames(u32 count);
+  bool halted() const { return dev[0x0f]; }
+  u64 frames() const { return frame_count; }
+
+  // Input goes through these straight to the ROM's vectors.
+  Input& controls() { return input; }
+  Console& stdin_console() { return console; }
+
+  const u32* framebuffer() const { return screen.framebuffer(); }
+  // Composites big repaints on the threads of `bands`, or on the calling
+  // thread alone if null (the default). Instances can share one.
+  void composite_with(BandCompositor* bands) { screen.compositor = bands; }
+  u16 width() const { return screen.width(); }
+  u16 height() const { return screen.height(); }
+
+  // Snapshots also keep the virtual clock and the frame count; restoring
+  // one repaints the framebuffer.
+  void save_devices(StateWriter& out) override;
+  bool load_devices(StateReader& in) override;
+
+  // Plays back a recording (see Event) instead of init, from any frontend:
+  // the screen takes the recorded size, the clock and audio read what they
+  // read then, and each vector runs exactly as far as it did. A frame of
+  // virtual time passes with each recorded frame. Returns false if the
+  // file or the ROM can't be loaded, or the run stops matching the
+  // recording, leaving the machine where it went wrong.
+  bool replay(const char* path);
+  // The engine the last replayed recording was made on.
+  Engine recorded_on = Engine::Threaded;
+
+  void before_dei(u8 d) override;
+
+private:
+  u64 frame_count = 0;
+  // The values the running vector's DEIs read, when replaying.
+  const Event *next_read = nullptr, *reads_end = nullptr;
+  bool replaying = false, in_sync = true;
+};
+
+}
@@ -52,6 +52,10 @@ int SdlVarvara::handle_events() {
         set_debugger(dev[0x0e]);
       //else if (event.key.keysym.sym == SDLK_F3)
       //  capture_screen();
+#ifdef UXN_PROFILE
+      else if (event.key.keysym.sym == SDLK_F6)
+        dump_profile();
+#endif
       else if (event.key.keysym.sym == SDLK_F4)
         reset(false);
       else if (event.key.keysym.sym == SDLK_F5)
@@ -187,6 +191,15 @@ bool SdlScreen::init() {
   return true;
 }
 
+/* Prints the trace (see -trace) to stderr. */
+void SdlVarvara::on_trace(TraceReason why) {
+  struct Stderr : TraceOutput {
+    void line(const char* text) final { fprintf(stderr, "%s\n", text); }
+  } out;
+  fprintf(stderr, "Trace (%s):\n", trace_reason_name(why));
+  trace_dump(out);
+}
+
 void SdlVarvara::set_debugger(u8 value) {
   dev[0x0e] = value;
 }
@@ -217,8 +230,15 @@ u8 SdlVarvara::run() {
   u64 next_refresh = 0;
   u64 frame_interval = SDL_GetPerformanceFrequency() / 60;
 
+  /* Vectors give up the CPU at the end of each frame, and carry on in the
+     next one, so a busy ROM doesn't freeze the window. Input that comes
+     in meanwhile is queued and runs once the vector finishes; the screen
+     skips the frames it was busy for. */
+  if (!vector_budget) vector_budget = ~0u;
+
   /* game loop */
-  eval(PAGE_PROGRAM);
+  exec_deadline = SDL_GetPerformanceCounter() + frame_interval;
+  eval_for(PAGE_PROGRAM, vector_budget);
   while (!exit_state) {
     u64 now = SDL_GetPerformanceCounter();
     /* .System/halt */
@@ -226,7 +246,16 @@ u8 SdlVarvara::run() {
       error_message("Run", "Ended.");
       break;
     }
-    exec_deadline = now + deadline_interval;
+    exec_deadline = now + frame_interval;
+    if (!suspended()) {
+      busy_since = now, busy_reported = false;
+    } else {
+      resume(vector_budget);
+      if (suspended() && !busy_reported && now - busy_since > deadline_interval) {
+        error_message("Run", "Busy.");
+        busy_reported = true;
+      }
+    }
     if (!handle_events()) return false;
     bool should_wait = true;
     if (now >= next_refresh) {
@@ -234,6 +263,7 @@ u8 SdlVarvara::run() {
       next_refresh = now + frame_interval;
       should_wait = screen.frame();
     }
+    if (suspended()) continue;
     if (should_wait) {
       u64 delay_ms = (next_refresh - now) / ms_interval;
       if (delay_ms > 0) SDL_Delay(delay_ms);
@@ -244,8 +274,29 @@ u8 SdlVarvara::run() {
   return exit_state;
 }
 
+#ifdef UXN_PROFILE
+/* Writes what was counted so far to $UXN_PROFILE_OUT (uxn_profile.json by
+   default) and starts counting again. */
+void SdlVarvara::dump_profile() {
+  const char* path = getenv("UXN_PROFILE_OUT");
+  if (!path) path = "uxn_profile.json";
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    error_message("Profile", path);
+    return;
+  }
+  write_profile_json(f, profile, SDL_GetPerformanceFrequency());
+  fclose(f);
+  fprintf(stderr, "Profile: wrote %s\n", path);
+  profile.clear();
+}
+#endif
+
 SdlVarvara::~SdlVarvara() {
   /* cleanup */
+#ifdef UXN_PROFILE
+  dump_profile();
+#endif
 #ifdef _WIN32
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
   TerminateThread((HANDLE)SDL_GetThreadID(stdin_thread), 0);
@@ -256,10 +307,21 @@ SdlVarvara::~SdlVarvara() {
 
 }
 
+/* Writes a recording as it's made, for -record. */
+struct RecordingFile : uxn::StateWriter {
+  FILE* f;
+  RecordingFile(FILE* f) : f(f) {}
+  ~RecordingFile() { if (f) fclose(f); }
+  void write(const void* data, u32 length) final { fwrite(data, 1, length, f); }
+};
+
 int main(int argc, char **argv) {
   int i = 1;
   u8 zoom = 0;
-  bool fullscreen = false;
+  bool fullscreen = false, jit = false, aot = false;
+  const char* record = nullptr;
+  u32 trace = 0;
+  uxn::Hle hle = uxn::Hle::Off;
   /* flags */
   if (argc > 1 && argv[i][0] == '-') {
     if (!strcmp(argv[i], "-v")) {
@@ -271,6 +333,21 @@ int main(int argc, char **argv) {
       zoom = 3;
     } else if (strcmp(argv[i], "-f") == 0) {
       fullscreen = true;
+    } else if (!strcmp(argv[i], "-jit")) {
+      jit = true;
+    } else if (!strcmp(argv[i], "-aot")) {
+      aot = true;
+    } else if (!strcmp(argv[i], "-hle")) {
+      hle = uxn::Hle::On;
+    } else if (!strcmp(argv[i], "-hle-verify")) {
+      hle = uxn::Hle::Verify;
+    } else if (!strcmp(argv[i], "-record") && i + 1 < argc) {
+      /* everything the ROM gets from outside, for uxn_replay */
+      record = argv[++i];
+    } else if (!strcmp(argv[i], "-trace") && i + 1 < argc) {
+      /* the last N jumps and device writes, printed on halt, stack
+         wrap-around or System/debug */
+      trace = atoi(argv[++i]);
     }
     i++;
   }
@@ -278,6 +355,17 @@ int main(int argc, char **argv) {
   char cwd[uxn::UXN_PATH_MAX / 2];
   getcwd(cwd, sizeof(cwd));
   uxn::SdlVarvara uxn(640, 480, cwd, rom_name);
+  if (jit) uxn.engine = uxn::Engine::Jit;
+  if (aot) uxn.engine = uxn::Engine::Aot;
+  uxn.hle = hle;
+  uxn.trace_start(trace);
   if (!uxn.init()) return 1;
+  FILE* f = nullptr;
+  if (record && !(f = fopen(record, "wb"))) {
+    fprintf(stderr, "Could not write %s\n", record);
+    return 1;
+  }
+  RecordingFile recording(f);
+  if (f) uxn.record(&recording);
   return uxn.run();
 }
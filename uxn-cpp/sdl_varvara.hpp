@@ -1,8 +1,9 @@
 #pragma once
-#include "varvara.hpp"
+#include "banded_screen.hpp"
 #include "stdlib_console.hpp"
 #include "stdlib_filesystem.hpp"
 #include "posix_datetime.hpp"
+#include "uxn_profile.hpp"
 #include <SDL2/SDL.h>
 
 namespace uxn {
@@ -23,8 +24,9 @@ static inline void error_message(const char* ctx, const char* msg) {
   std::cerr << ctx << ": " << msg << std::endl;
 }
 
-class SdlScreen : public PixelScreen<SDL_Color> {
+class SdlScreen : public BandedScreen<SDL_Color> {
 private:
+  BandCompositor bands;
   SDL_Window* emu_window = nullptr;
   SDL_Texture* emu_texture = nullptr;
   SDL_Renderer* emu_renderer = nullptr;
@@ -34,20 +36,25 @@ private:
 
 public:
   SdlScreen(Uxn& uxn, u16 w, u16 h, u8 zoom = 1, bool fullscreen = false, bool borderless = false) :
-    PixelScreen(uxn, w, h),
+    BandedScreen(uxn, w, h),
     zoom(zoom),
     fullscreen(fullscreen),
-    borderless(borderless) {}
+    borderless(borderless) {
+    compositor = &bands;
+  }
   virtual ~SdlScreen() {}
 
   virtual bool init();
   virtual SDL_Color color_from_12bit(u8 r, u8 g, u8 b, u8 ix) const final {
     return { .r = (u8)(r | (r << 4)), .g = (u8)(g | (g << 4)), .b = (u8)(b | (b << 4)) };
   };
-  virtual void on_paint() {
+  virtual void on_paint(const Rect* rects, u32 count) {
     if (!emu_renderer) return;
-    if (SDL_UpdateTexture(emu_texture, NULL, pixels, w * sizeof(SDL_Color)) != 0)
-      error_message("SDL_UpdateTexture", SDL_GetError());
+    for (u32 i = 0; i < count; i++) {
+      SDL_Rect area = { rects[i].x, rects[i].y, rects[i].w, rects[i].h };
+      if (SDL_UpdateTexture(emu_texture, &area, pixels + area.y * w + area.x, w * sizeof(SDL_Color)) != 0)
+        error_message("SDL_UpdateTexture", SDL_GetError());
+    }
     SDL_RenderClear(emu_renderer);
     SDL_RenderCopy(emu_renderer, emu_texture, NULL, &emu_viewport);
     SDL_RenderPresent(emu_renderer);
@@ -118,6 +125,8 @@ protected:
 
   u8 exit_state = 0;
   u64 exec_deadline, deadline_interval, ms_interval;
+  u64 busy_since = 0; // last loop with no vector suspended
+  bool busy_reported = false;
 
   static Button get_button_joystick(SDL_Event* event) {
     return static_cast<Button>(0x01 << (event->jbutton.button & 0x3));
@@ -131,6 +140,15 @@ protected:
 
   void audio_finished_handler(int instance);
   void set_debugger(u8 value);
+  bool past_deadline() final { return SDL_GetPerformanceCounter() >= exec_deadline; }
+#ifdef UXN_PROFILE
+  u64 profile_clock() final { return SDL_GetPerformanceCounter(); }
+  void dump_profile();
+#endif
+  void hle_mismatch(const Hook& hook, u16 addr) final {
+    fprintf(stderr, "HLE: %s at %04x doesn't match the ROM code, not hooking it\n", hook.name, addr);
+  }
+  void on_trace(TraceReason why) final;
 
 public:
   static constexpr KeyMap default_key_map {
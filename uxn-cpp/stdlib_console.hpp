@@ -5,16 +5,17 @@
 namespace uxn {
 
 class StdlibConsole : public Console {
+  std::ostream& out;
 public:
-  StdlibConsole(Uxn& uxn) : Console(uxn) {}
+  StdlibConsole(Uxn& uxn, std::ostream& out = std::cout) : Console(uxn), out(out) {}
 
   void write_byte(u8 b) final {
-    if (b == '\n') std::cout << std::endl;
-    else std::cout << static_cast<char>(b);
+    if (b == '\n') out << std::endl;
+    else out << static_cast<char>(b);
   }
 
   void flush() {
-    std::flush(std::cout);
+    std::flush(out);
   }
 };
 
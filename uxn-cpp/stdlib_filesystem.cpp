@@ -1,6 +1,12 @@
 #include "stdlib_filesystem.hpp"
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 using std::cerr, std::filesystem::directory_iterator, std::endl,
     std::error_code, std::get_if, std::holds_alternative, std::ifstream,
@@ -8,6 +14,67 @@ using std::cerr, std::filesystem::directory_iterator, std::endl,
 
 namespace uxn {
 
+  RomImage::~RomImage() {
+    if (mapping) munmap(mapping, size);
+    if (fd >= 0) ::close(fd);
+  }
+
+  void RomImage::read_from(int from) {
+    u8 buf[0x1000];
+    ssize_t n;
+    for (off_t at = 0; (n = pread(from, buf, sizeof(buf), at)) > 0; at += n) bytes.insert(bytes.end(), buf, buf + n);
+    data = bytes.data();
+    size = bytes.size();
+  }
+
+  std::shared_ptr<const RomImage> RomImage::open(const std::filesystem::path& path) {
+    using Key = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+    static std::mutex lock;
+    static std::map<Key, std::weak_ptr<const RomImage>> shared_images;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st)) {
+      ::close(fd);
+      return nullptr;
+    }
+    Key key { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+    std::lock_guard<std::mutex> l(lock);
+    if (auto shared = shared_images[key].lock()) {
+      ::close(fd);
+      return shared;
+    }
+    auto rom = std::make_shared<RomImage>();
+    void* addr = st.st_size > 0x10000 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (addr != MAP_FAILED) {
+      rom->mapping = addr;
+      rom->data = static_cast<const u8*>(addr);
+      rom->size = st.st_size;
+      rom->fd = fd;
+      rom->mapped_size = st.st_size;
+      rom->mapped_mtime = st.st_mtim;
+    } else {
+      rom->read_from(fd);
+      ::close(fd);
+    }
+    for (auto i = shared_images.begin(); i != shared_images.end();) i = i->second.expired() ? shared_images.erase(i) : std::next(i);
+    shared_images[key] = rom;
+    return rom;
+  }
+
+  bool RomImage::changed() const {
+    struct stat st;
+    if (!mapping || fstat(fd, &st)) return false;
+    return st.st_size != mapped_size || st.st_mtim.tv_sec != mapped_mtime.tv_sec || st.st_mtim.tv_nsec != mapped_mtime.tv_nsec;
+  }
+
+  std::shared_ptr<const RomImage> RomImage::read_again() const {
+    auto rom = std::make_shared<RomImage>();
+    rom->read_from(fd);
+    return rom;
+  }
+
   bool StdlibFilesystem::init() {
     error_code ec;
     root_dir = weakly_canonical(original_root_dir, ec);
@@ -29,20 +96,29 @@ namespace uxn {
       cerr << "ROM path " << path << " is not in sandbox directory " << root_dir << endl;
       return nullptr;
     }
-    ifstream file(path, ios::binary | ios::ate);
-    auto sz = file.tellg();
-    if (!file.is_open()) {
+    auto rom = RomImage::open(path);
+    if (!rom) {
       cerr << "ROM " << filename << " does not exist or cannot be opened" << endl;
       return nullptr;
     }
-    loaded_rom.resize(sz);
-    file.seekg(0, ios::beg);
-    if (!file.read((char *)loaded_rom.data(), sz)) {
+    if (!rom->size) {
       cerr << "ROM " << filename << " could not be read" << endl;
       return nullptr;
     }
-    out_size = sz;
-    return loaded_rom.data();
+    loaded_rom = rom;
+    out_size = rom->size;
+    return rom->data;
+  }
+
+  // A big ROM stays mapped only while its file is unchanged; after that
+  // it's read in as it is now, which is what a reset after reassembling
+  // it expects.
+  bool StdlibFilesystem::reload(const u8*& rom, size_t& size) {
+    if (!loaded_rom || !loaded_rom->changed()) return false;
+    loaded_rom = loaded_rom->read_again();
+    rom = loaded_rom->data;
+    size = loaded_rom->size;
+    return true;
   }
 
   Stat StdlibFilesystem::stat() {
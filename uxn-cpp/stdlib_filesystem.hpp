@@ -2,12 +2,45 @@
 #include "varvara.hpp"
 #include <fstream>
 #include <filesystem>
+#include <memory>
 #include <string>
 #include <vector>
 #include <variant>
+#include <sys/types.h>
+#include <time.h>
 
 namespace uxn {
 
+// A ROM file, read into memory if it fits in `ram` (where it's copied
+// anyway) and mapped read-only if it's bigger. Every instance that loads
+// the same file (same device, inode, size and modification time) shares
+// one image for as long as any of them has it loaded; memory only becomes
+// theirs as they copy it into `ram` or write to banks (see Bank). Files
+// that can't be mapped are read instead.
+class RomImage {
+public:
+  const u8* data = nullptr;
+  size_t size = 0;
+
+  ~RomImage();
+  static std::shared_ptr<const RomImage> open(const std::filesystem::path& path);
+  // Whether a mapped file no longer has the size and modification time it
+  // was mapped with. One rewritten in place (as uxnasm does) can have
+  // pages that fault or hold the new file's bytes.
+  bool changed() const;
+  // The file as it is now, read into memory.
+  std::shared_ptr<const RomImage> read_again() const;
+
+private:
+  void* mapping = nullptr;
+  int fd = -1; // kept open while mapped, to check the file for changes
+  off_t mapped_size = 0;
+  timespec mapped_mtime = {};
+  std::vector<u8> bytes;
+
+  void read_from(int from);
+};
+
 class StdlibFilesystem : public Filesystem {
 private:
   std::filesystem::path original_root_dir, root_dir;
@@ -18,7 +51,7 @@ private:
     std::ofstream
   > open_file;
   std::string last_dir_entry_name;
-  std::vector<u8> loaded_rom;
+  std::shared_ptr<const RomImage> loaded_rom;
 
   bool is_in_root_dir(std::filesystem::path p) {
     auto [root_end, nothing] = std::mismatch(root_dir.begin(), root_dir.end(), p.begin());
@@ -31,6 +64,7 @@ public:
 
   virtual bool init();
   const u8* load(const char* filename, size_t& out_size) final;
+  bool reload(const u8*& rom, size_t& size) final;
 
 protected:
   void close() final { open_file = std::monostate(); }
@@ -36,111 +36,359 @@ namespace uxn {
 #define SHIFT(y)  { s->ptr += (y); }
 #define SET(x, y) { SHIFT((ins & 0x80) ? x + y : y) }
 
-bool Uxn::eval(u16 pc) {
+#ifdef UXN_PROFILE
+#define DEI(p)    { u8 d = (p); u64 c = profile_clock(); before_dei(d); prof->dei[d]++; prof->dei_ticks[d] += profile_clock() - c; }
+#define DEO(p)    { u8 d = (p); trace_deo(d); u64 c = profile_clock(); after_deo(d); prof->deo[d]++; prof->deo_ticks[d] += profile_clock() - c; }
+#define BRK       { prof->ticks += profile_clock() - started; return 1; }
+#else
+#define DEI(p)    before_dei(p)
+#define DEO(p)    { u8 d = (p); trace_deo(d); after_deo(d); }
+#define BRK       return 1
+#endif
+#define STORED(a)
+#define CALLED    { if (hle_at(pc)) hle_call(pc); }
+#define JUMPED    trace_jump(pc, ins, wst.ptr, rst.ptr)
+
+bool Uxn::eval_switch(u16 pc, Budget* budget) {
   u16 t, n, l, r;
   u8 *ram = this->ram, *rr;
   if (!initialized || !pc || dev[0x0f]) return 0;
+#ifdef UXN_PROFILE
+  if (!profile.current) profile.enter(pc);
+  VectorProfile* prof = profile.current;
+  u64 started = profile_clock();
+#endif
   for(;;) {
+    if (budget && !budget->left--) {
+      budget->left = 0, budget->pc = pc, budget->stopped = true;
+#ifdef UXN_PROFILE
+      prof->ticks += profile_clock() - started;
+#endif
+      return 1;
+    }
+#ifdef UXN_PROFILE
+    prof->instructions++, prof->opcodes[ram[pc]]++, prof->pcs[pc]++;
+#endif
     u8 ins = ram[pc++];
     Stack *s = ins & 0x40 ? &rst : &wst;
     switch(ins & 0x3f) {
-    /* IMM */
-    case 0x00: case 0x20:
-      switch(ins) {
-      case 0x00: /* BRK  */                       return 1;
-      case 0x20: /* JCI  */ t=T;        SHIFT(-1) if(!t) { pc += 2; break; } /* fall-through */
-      case 0x40: /* JMI  */                       rr = ram + pc; pc += 2 + peek2(rr); break;
-      case 0x60: /* JSI  */             SHIFT( 2) rr = ram + pc; pc += 2; T2_(pc); pc += peek2(rr); break;
-      case 0x80: /* LIT  */ case 0xc0:  SHIFT( 1) T = ram[pc++]; break;
-      case 0xa0: /* LIT2 */ case 0xe0:  SHIFT( 2) N = ram[pc++]; T = ram[pc++]; break;
-      } break;
-    /* ALU */
-    case 0x01: /* INC  */ t=T;            SET(1, 0) T = t + 1; break;
-    case 0x21: /* INC2 */ t=T2;           SET(2, 0) T2_(t + 1) break;
-    case 0x02: /* POP  */                 SET(1,-1) break;
-    case 0x22: /* POP2 */                 SET(2,-2) break;
-    case 0x03: /* NIP  */ t=T;            SET(2,-1) T = t; break;
-    case 0x23: /* NIP2 */ t=T2;           SET(4,-2) T2_(t) break;
-    case 0x04: /* SWP  */ t=T;n=N;        SET(2, 0) T = n; N = t; break;
-    case 0x24: /* SWP2 */ t=T2;n=N2;      SET(4, 0) T2_(n) N2_(t) break;
-    case 0x05: /* ROT  */ t=T;n=N;l=L;    SET(3, 0) T = l; N = t; L = n; break;
-    case 0x25: /* ROT2 */ t=T2;n=N2;l=L2; SET(6, 0) T2_(l) N2_(t) L2_(n) break;
-    case 0x06: /* DUP  */ t=T;            SET(1, 1) T = t; N = t; break;
-    case 0x26: /* DUP2 */ t=T2;           SET(2, 2) T2_(t) N2_(t) break;
-    case 0x07: /* OVR  */ t=T;n=N;        SET(2, 1) T = n; N = t; L = n; break;
-    case 0x27: /* OVR2 */ t=T2;n=N2;      SET(4, 2) T2_(n) N2_(t) L2_(n) break;
-    case 0x08: /* EQU  */ t=T;n=N;        SET(2,-1) T = n == t; break;
-    case 0x28: /* EQU2 */ t=T2;n=N2;      SET(4,-3) T = n == t; break;
-    case 0x09: /* NEQ  */ t=T;n=N;        SET(2,-1) T = n != t; break;
-    case 0x29: /* NEQ2 */ t=T2;n=N2;      SET(4,-3) T = n != t; break;
-    case 0x0a: /* GTH  */ t=T;n=N;        SET(2,-1) T = n > t; break;
-    case 0x2a: /* GTH2 */ t=T2;n=N2;      SET(4,-3) T = n > t; break;
-    case 0x0b: /* LTH  */ t=T;n=N;        SET(2,-1) T = n < t; break;
-    case 0x2b: /* LTH2 */ t=T2;n=N2;      SET(4,-3) T = n < t; break;
-    case 0x0c: /* JMP  */ t=T;            SET(1,-1) pc += (s8)t; break;
-    case 0x2c: /* JMP2 */ t=T2;           SET(2,-2) pc = t; break;
-    case 0x0d: /* JCN  */ t=T;n=N;        SET(2,-2) if(n) pc += (s8)t; break;
-    case 0x2d: /* JCN2 */ t=T2;n=L;       SET(3,-3) if(n) pc = t; break;
-    case 0x0e: /* JSR  */ t=T;            SET(1,-1) FLIP SHIFT(2) T2_(pc) pc += (s8)t; break;
-    case 0x2e: /* JSR2 */ t=T2;           SET(2,-2) FLIP SHIFT(2) T2_(pc) pc = t; break;
-    case 0x0f: /* STH  */ t=T;            SET(1,-1) FLIP SHIFT(1) T = t; break;
-    case 0x2f: /* STH2 */ t=T2;           SET(2,-2) FLIP SHIFT(2) T2_(t) break;
-    case 0x10: /* LDZ  */ t=T;            SET(1, 0) T = ram[t]; break;
-    case 0x30: /* LDZ2 */ t=T;            SET(1, 1) N = ram[t++]; T = ram[(u8)t]; break;
-    case 0x11: /* STZ  */ t=T;n=N;        SET(2,-2) ram[t] = n; break;
-    case 0x31: /* STZ2 */ t=T;n=H2;       SET(3,-3) ram[t++] = n >> 8; ram[(u8)t] = n; break;
-    case 0x12: /* LDR  */ t=T;            SET(1, 0) r = pc + (s8)t; T = ram[r]; break;
-    case 0x32: /* LDR2 */ t=T;            SET(1, 1) r = pc + (s8)t; N = ram[r++]; T = ram[r]; break;
-    case 0x13: /* STR  */ t=T;n=N;        SET(2,-2) r = pc + (s8)t; ram[r] = n; break;
-    case 0x33: /* STR2 */ t=T;n=H2;       SET(3,-3) r = pc + (s8)t; ram[r++] = n >> 8; ram[r] = n; break;
-    case 0x14: /* LDA  */ t=T2;           SET(2,-1) T = ram[t]; break;
-    case 0x34: /* LDA2 */ t=T2;           SET(2, 0) N = ram[t++]; T = ram[t]; break;
-    case 0x15: /* STA  */ t=T2;n=L;       SET(3,-3) ram[t] = n; break;
-    case 0x35: /* STA2 */ t=T2;n=N2;      SET(4,-4) ram[t++] = n >> 8; ram[t] = n; break;
-    case 0x16: /* DEI  */ t=T;            SET(1, 0) before_dei(t); T = dev[t]; break;
-    case 0x36: /* DEI2 */ t=T;            SET(1, 1) before_dei(t); before_dei(t+1); N = dev[t++]; T = dev[t]; break;
-    case 0x17: /* DEO  */ t=T;n=N;        SET(2,-2) dev[t] = n; after_deo(t); break;
-    case 0x37: /* DEO2 */ t=T;n=N;l=L;    SET(3,-3) dev[t] = l; dev[t+1] = n; after_deo(t++); after_deo(t); break;
-    case 0x18: /* ADD  */ t=T;n=N;        SET(2,-1) T = n + t; break;
-    case 0x38: /* ADD2 */ t=T2;n=N2;      SET(4,-2) T2_(n + t) break;
-    case 0x19: /* SUB  */ t=T;n=N;        SET(2,-1) T = n - t; break;
-    case 0x39: /* SUB2 */ t=T2;n=N2;      SET(4,-2) T2_(n - t) break;
-    case 0x1a: /* MUL  */ t=T;n=N;        SET(2,-1) T = n * t; break;
-    case 0x3a: /* MUL2 */ t=T2;n=N2;      SET(4,-2) T2_(n * t) break;
-    case 0x1b: /* DIV  */ t=T;n=N;        SET(2,-1) T = t ? n / t : 0; break;
-    case 0x3b: /* DIV2 */ t=T2;n=N2;      SET(4,-2) T2_(t ? n / t : 0) break;
-    case 0x1c: /* AND  */ t=T;n=N;        SET(2,-1) T = n & t; break;
-    case 0x3c: /* AND2 */ t=T2;n=N2;      SET(4,-2) T2_(n & t) break;
-    case 0x1d: /* ORA  */ t=T;n=N;        SET(2,-1) T = n | t; break;
-    case 0x3d: /* ORA2 */ t=T2;n=N2;      SET(4,-2) T2_(n | t) break;
-    case 0x1e: /* EOR  */ t=T;n=N;        SET(2,-1) T = n ^ t; break;
-    case 0x3e: /* EOR2 */ t=T2;n=N2;      SET(4,-2) T2_(n ^ t) break;
-    case 0x1f: /* SFT  */ t=T;n=N;        SET(2,-1) T = n >> (t & 0xf) << (t >> 4); break;
-    case 0x3f: /* SFT2 */ t=T;n=H2;       SET(3,-1) T2_(n >> (t & 0xf) << (t >> 4)) break;
+#include "uxn_ops.hpp"
     }
   }
 }
 
+bool Uxn::eval_for(u16 pc, u32 budget) {
+  if (!initialized || !pc || dev[0x0f]) return 0;
+#ifdef UXN_PROFILE
+  if (pc != resume_pc) profile.enter(pc);
+#endif
+  resume_pc = 0;
+  before_run(pc);
+  u16 start = pc;
+  u32 ran = 0;
+  for (;;) {
+    Budget slice = { budget < DEADLINE_SLICE ? budget : DEADLINE_SLICE };
+    u32 granted = slice.left;
+    eval(pc, &slice);
+    ran += granted - slice.left;
+    budget -= granted - slice.left;
+    if (!slice.stopped) {
+      counters.instructions += ran;
+      after_run(start, ran, true);
+      return 1;
+    }
+    pc = slice.pc;
+    if (!budget || past_deadline()) break;
+  }
+  counters.instructions += ran;
+  resume_pc = pc;
+  counters.suspended++;
+  after_run(start, ran, false);
+  return 1;
+}
+
+// Another call of a device's vector just like the last one queued, with
+// the same ports (audio asking again, say), adds nothing.
+void Uxn::queue_vec(u8 d) {
+  const u8* ports = dev + (d & 0xf0);
+  for (u32 i = queued_count; i-- > 0;) {
+    if (queued[i].d != d) continue;
+    if (!__builtin_memcmp(queued[i].ports, ports, 16)) return;
+    break;
+  }
+  if (queued_count == MAX_QUEUED) return;
+  queued[queued_count].d = d;
+  __builtin_memcpy(queued[queued_count++].ports, ports, 16);
+}
+
+// Each queued vector sees its device's ports as the host left them when it
+// was called, but the vector the ROM has set now. If one of them is cut
+// short in turn, the rest wait for it.
+void Uxn::run_queued() {
+  u32 i = 0;
+  while (i < queued_count && !resume_pc && !dev[0x0f]) {
+    const QueuedVector& q = queued[i++];
+    u8* ports = dev + (q.d & 0xf0);
+    u16 addr = peek2(dev + q.d);
+    __builtin_memcpy(ports, q.ports, 16);
+    poke2(dev + q.d, addr);
+    if (!addr) continue;
+    if (vector_budget) eval_for(addr, vector_budget);
+    else eval(addr);
+  }
+  for (u32 j = i; j < queued_count; j++) queued[j - i] = queued[j];
+  queued_count -= i;
+}
+
 bool Uxn::init() {
+  reset_rom = nullptr;
   reset(false);
   initialized = true;
   return true;
 }
 
+namespace {
+
+const u8 zero_page[BANK_PAGE] = {0};
+
+// Makes mem[0, length) hold `src` (as much of it as fits) followed by
+// zeros, if it doesn't already. Returns whether anything had to change.
+// The builtins are the C library's (or Circle's) memcmp and friends.
+bool reset_page(u8* mem, u32 length, const u8* src, u32 src_size) {
+  u32 n = src_size < length ? src_size : length;
+  if (!__builtin_memcmp(mem, src, n) && !__builtin_memcmp(mem + n, zero_page, length - n)) return false;
+  __builtin_memcpy(mem, src, n);
+  __builtin_memset(mem + n, 0, length - n);
+  return true;
+}
+
+}
+
 void Uxn::reset(bool soft) {
+  bool same_rom = boot_rom == reset_rom && boot_rom_size == reset_rom_size && hle == reset_hle;
+  if (!same_rom) {
+    decoded_release();
+    jit_release();
+  }
+  delete snapshot_base;
+  snapshot_base = nullptr;
+  // The engines don't keep track of which pages they store to, so every
+  // page of ram is compared with the ROM (and a hard reset's zero page
+  // with zeros); only the ones that differ are copied (and dropped from
+  // the caches).
+  if (!soft && reset_page(ram, PAGE_PROGRAM, zero_page, 0)) ram_written(0, PAGE_PROGRAM);
+  for (u32 addr = PAGE_PROGRAM; addr < 0x10000;) {
+    u32 end = (addr & ~(BANK_PAGE - 1)) + BANK_PAGE, rom_at = addr - PAGE_PROGRAM;
+    if (reset_page(ram + addr, end - addr, boot_rom + rom_at, rom_at < boot_rom_size ? boot_rom_size - rom_at : 0))
+      ram_written(addr, end - addr);
+    addr = end;
+  }
+  // Banks only hold the pages written since, which go back to reading
+  // from the ROM.
   if (banks) delete banks;
-  u32 i;
-  if (!soft) for (i = 0; i < PAGE_PROGRAM; i++) ram[i] = 0;
-  for (i = 0; i < 0x10000 - PAGE_PROGRAM; i++) {
-    ram[PAGE_PROGRAM + i] = i < boot_rom_size ? boot_rom[i] : 0;
+  banks = nullptr;
+  for (u32 i = 0x0; i < 0x100; i++) dev[i] = 0;
+  wst.ptr = rst.ptr = 0;
+  resume_pc = 0;
+  queued_count = 0;
+  if (same_rom) aot_valid = aot;
+  else aot_reset();
+  hle_reset();
+  trace_rebase();
+  trace_faults = 0, trace_reported = false;
+  reset_rom = boot_rom, reset_rom_size = boot_rom_size, reset_hle = hle;
+}
+
+// Where the ROM's bytes for page p of a bank are, and how many it has.
+const u8* Uxn::rom_page(u16 index, u8 p, u32& size) const {
+  u32 at = 0x10000 - PAGE_PROGRAM + (index - 1) * 0x10000 + p * BANK_PAGE;
+  size = at < boot_rom_size ? boot_rom_size - at : 0;
+  if (size > BANK_PAGE) size = BANK_PAGE;
+  return size ? boot_rom + at : nullptr;
+}
+
+u8* Uxn::bank_fault(Bank& b, u16 index, u8 p) {
+  u32 size;
+  const u8* rom = rom_page(index, p, size);
+  u8* page = new u8[BANK_PAGE];
+  if (size) __builtin_memcpy(page, rom, size);
+  __builtin_memset(page + size, 0, BANK_PAGE - size);
+  b.pages[p] = page;
+  b.written |= 1 << p;
+  return page;
+}
+
+const u8* Uxn::bank_read(u16 index, u16 addr) {
+  if (index == 0) return ram + addr;
+  u8 p = addr / BANK_PAGE;
+  Bank* b = banks ? banks->find(index) : nullptr;
+  if (b && b->pages[p]) return b->pages[p] + addr % BANK_PAGE;
+  u32 size;
+  const u8* rom = rom_page(index, p, size);
+  if (!size) return zero_page + addr % BANK_PAGE;
+  if (size == BANK_PAGE) return rom + addr % BANK_PAGE;
+  // The ROM ends partway through the page.
+  if (!banks) banks = new BankIndex1;
+  return bank_fault((*banks)[index], index, p) + addr % BANK_PAGE;
+}
+
+u8* Uxn::bank_write(u16 index, u16 addr) {
+  if (index == 0) return ram + addr;
+  u8 p = addr / BANK_PAGE;
+  if (!banks) banks = new BankIndex1;
+  Bank& b = (*banks)[index];
+  if (!b.pages[p]) return bank_fault(b, index, p) + addr % BANK_PAGE;
+  b.written |= 1 << p;
+  return b.pages[p] + addr % BANK_PAGE;
+}
+
+size_t Uxn::bank_memory() const {
+  if (!banks) return 0;
+  size_t bytes = sizeof(BankIndex1) + banks->tables() * sizeof(BankIndex2);
+  banks->each([&](u16, Bank& b) {
+    bytes += sizeof(Bank);
+    for (u32 p = 0; p < BANK_PAGES; p++) if (b.pages[p]) bytes += BANK_PAGE;
+  });
+  return bytes;
+}
+
+void Uxn::trace_start(u32 entries) {
+  if (tracing()) delete[] trace_ring;
+  trace_ring = &trace_scratch, trace_mask = 0, trace_next = 0;
+  if (!entries) return;
+  while (entries & (entries - 1)) entries &= entries - 1;
+  trace_ring = new u64[entries];
+  trace_mask = entries - 1;
+}
+
+void Uxn::stack_wrapped() {
+  trace_faults = 0;
+  if (!tracing() || trace_reported) return;
+  trace_reported = true;
+  on_trace(TraceReason::Stack);
+}
+
+void opcode_name(u8 ins, char out[8]) {
+  static const char names[0x20][4] = {
+    "BRK", "INC", "POP", "NIP", "SWP", "ROT", "DUP", "OVR",
+    "EQU", "NEQ", "GTH", "LTH", "JMP", "JCN", "JSR", "STH",
+    "LDZ", "STZ", "LDR", "STR", "LDA", "STA", "DEI", "DEO",
+    "ADD", "SUB", "MUL", "DIV", "AND", "ORA", "EOR", "SFT"
+  };
+  static const char immediate[8][6] = { "BRK", "JCI", "JMI", "JSI", "LIT", "LIT2", "LITr", "LIT2r" };
+  const char* name = ins & 0x1f ? names[ins & 0x1f] : immediate[ins >> 5];
+  u32 n = 0;
+  while (*name) out[n++] = *name++;
+  if (ins & 0x1f) {
+    if (ins & 0x20) out[n++] = '2';
+    if (ins & 0x80) out[n++] = 'k';
+    if (ins & 0x40) out[n++] = 'r';
+  }
+  out[n] = 0;
+}
+
+const char* trace_reason_name(TraceReason why) {
+  switch (why) {
+    case TraceReason::Halt: return "halted";
+    case TraceReason::Stack: return "stack wrapped";
+    case TraceReason::Request: return "System/debug";
+  }
+  return "?";
+}
+
+namespace {
+
+bool is_control(u8 ins) {
+  u8 op = ins & 0x1f;
+  return op == 0x00 ? ins != 0x80 && ins != 0xa0 && ins != 0xc0 && ins != 0xe0 : op >= 0x0c && op <= 0x0e;
+}
+
+u8 op_length(u8 ins) {
+  switch (ins) {
+    case 0x20: case 0x40: case 0x60: case 0xa0: case 0xe0: return 3;
+    case 0x80: case 0xc0: return 2;
+    default: return 1;
+  }
+}
+
+// Builds a line of the dump.
+struct Line {
+  char text[40];
+  u32 n = 0;
+
+  Line& str(const char* s) {
+    while (*s && n < sizeof(text) - 1) text[n++] = *s++;
+    return *this;
+  }
+  Line& hex(u32 v, u32 digits) {
+    for (u32 i = digits; i--;) if (n < sizeof(text) - 1) text[n++] = "0123456789abcdef"[v >> (i * 4) & 0xf];
+    return *this;
   }
-  for (u32 bank_ix = 1; bank_ix < 0x10000 && i < boot_rom_size; bank_ix++) {
-    for (u32 offset = 0; offset < 0x10000 && i < boot_rom_size; i++, offset++) {
-      bank(bank_ix)[offset] = boot_rom[i];
+  void to(TraceOutput& out) {
+    text[n] = 0;
+    out.line(text);
+  }
+};
+
+void deo_line(TraceOutput& out, u64 e) {
+  Line().str("       DEO ").hex(e >> 16 & 0xff, 2).str(" <- ").hex(e >> 24 & 0xff, 2).to(out);
+}
+
+}
+
+/* The ring holds where each run of straight-line code started, so the
+   dump walks `ram` from there to the control instruction that made the
+   next entry (or to a BRK, or where the next run started), and places
+   the device writes at the DEOs they came from. */
+void Uxn::trace_dump(TraceOutput& out) const {
+  if (!tracing()) return;
+  u32 kept = trace_next < trace_mask + 1 ? trace_next : trace_mask + 1;
+  u32 first = trace_next - kept;
+  // Device writes before the first jump kept have no code to go with.
+  while (first != trace_next && trace_ring[first & trace_mask] & TRACE_DEO) first++;
+  for (u32 i = first; i != trace_next;) {
+    u64 e = trace_ring[i++ & trace_mask];
+    u16 pc = e;
+    Line().str(e >> 16 & 0xff ? "     -> " : "run ").hex(pc, 4).str("  w:").hex(e >> 24 & 0xff, 2).str(" r:").hex(e >> 32 & 0xff, 2).to(out);
+    // Where the next entry that isn't a device write says this run ended.
+    u32 end = i;
+    while (end != trace_next && trace_ring[end & trace_mask] & TRACE_DEO) end++;
+    bool to_start = end != trace_next && !(trace_ring[end & trace_mask] >> 16 & 0xff);
+    u16 next_start = end != trace_next ? static_cast<u16>(trace_ring[end & trace_mask]) : 0;
+    for (u32 steps = 0; steps < 0x100; steps++) {
+      if (to_start && pc == next_start && steps) break;
+      u8 ins = ram[pc];
+      char name[8];
+      opcode_name(ins, name);
+      Line().hex(pc, 4).str(" ").str(name).to(out);
+      for (u8 writes = (ins & 0x1f) == 0x17 ? 1 + (ins >> 5 & 1) : 0; writes && i != end; writes--)
+        deo_line(out, trace_ring[i++ & trace_mask]);
+      if (!ins || is_control(ins)) break;
+      pc += op_length(ins);
     }
+    // Device writes the walk didn't find a DEO for.
+    for (; i != end; i++) deo_line(out, trace_ring[i & trace_mask]);
   }
-  for (i = 0x0; i < 0x100; i++) dev[i] = 0;
-  wst.ptr = rst.ptr = 0;
 }
 
+#ifdef UXN_PROFILE
+void Profile::enter(u16 vector) {
+  for (u8 i = 0; i < used; i++) {
+    if (vectors[i]->vector != vector) continue;
+    current = vectors[i];
+    current->entries++;
+    return;
+  }
+  if (used < MAX_VECTORS) vectors[used++] = new VectorProfile(vector);
+  current = vectors[used - 1];
+  current->entries++;
+}
+
+void Profile::clear() {
+  for (u8 i = 0; i < used; i++) delete vectors[i];
+  used = 0;
+  current = nullptr;
+}
+#endif
+
 }
@@ -13,6 +13,13 @@ static inline void poke2(u8* d, u16 v) {
   *(d) = (v) >> 8; (d)[1] = (v);
 }
 
+// FNV-1a.
+static inline u64 hash_bytes(const u8* d, u32 length) {
+  u64 h = 0xcbf29ce484222325ull;
+  for (u32 i = 0; i < length; i++) h = (h ^ d[i]) * 0x100000001b3ull;
+  return h;
+}
+
 struct Slice {
   const u8* data;
   u16 size;
@@ -31,8 +38,23 @@ struct MutableSlice {
 // Each memory array has 1 more byte than necessary, to prevent
 // a peek2 on the highest address from reading out of bounds.
 
+static constexpr u32 BANK_PAGE = 0x1000, BANK_PAGES = 0x10000 / BANK_PAGE;
+
+// Banks 1 to 0xffff (bank 0 is `ram`) are kept in 4 KB pages, allocated
+// when first written. Until then a page reads as whatever the ROM has for
+// it (a ROM too big for ram carries on into bank 1, 2 and so on), or as
+// zeros. `written` has a bit per page changed since the last snapshot.
 struct Bank {
-  u8 mem[0x10001] = {0};
+  u8* pages[BANK_PAGES] = {0};
+  u16 written = 0;
+
+  ~Bank() {
+    for (u32 p = 0; p < BANK_PAGES; p++) if (pages[p]) delete[] pages[p];
+  }
+  void drop(u8 p) {
+    if (pages[p]) delete[] pages[p];
+    pages[p] = nullptr;
+  }
 };
 
 class BankIndex2 {
@@ -42,17 +64,39 @@ public:
     if (!banks[ix]) banks[ix] = new Bank;
     return *banks[ix];
   }
+  Bank* find(u8 ix) const { return banks[ix]; }
+  void drop(u8 ix) {
+    if (banks[ix]) delete banks[ix];
+    banks[ix] = nullptr;
+  }
   ~BankIndex2() {
     for (size_t i = 0; i < 0x100; i++) if (banks[i]) delete banks[i];
   }
 };
 
+// Banks by number: the first level's index is the high byte, the second's
+// the low byte.
 class BankIndex1 {
   BankIndex2* banks[0x100] = {0};
 public:
-  BankIndex2& operator[](u8 ix) {
-    if (!banks[ix]) banks[ix] = new BankIndex2;
-    return *banks[ix];
+  Bank& operator[](u16 index) {
+    if (!banks[index >> 8]) banks[index >> 8] = new BankIndex2;
+    return (*banks[index >> 8])[index & 0xff];
+  }
+  Bank* find(u16 index) const { return banks[index >> 8] ? banks[index >> 8]->find(index & 0xff) : nullptr; }
+  void drop(u16 index) { if (banks[index >> 8]) banks[index >> 8]->drop(index & 0xff); }
+  u32 tables() const {
+    u32 n = 0;
+    for (u32 i = 0; i < 0x100; i++) n += banks[i] != nullptr;
+    return n;
+  }
+  // Calls f(index, bank) for every allocated bank; f may drop that bank.
+  template <typename F>
+  void each(F f) const {
+    for (u32 i = 0; i < 0x100; i++) {
+      if (!banks[i]) continue;
+      for (u32 j = 0; j < 0x100; j++) if (Bank* b = banks[i]->find(j)) f(static_cast<u16>(i << 8 | j), *b);
+    }
   }
   ~BankIndex1() {
     for (size_t i = 0; i < 0x100; i++) if (banks[i]) delete banks[i];
@@ -63,30 +107,311 @@ struct Stack {
   u8 dat[0x101], ptr;
 };
 
+// Interpreter loops selectable through Uxn::engine. All of them have the
+// same semantics; Threaded and Decoded need computed goto (GCC/Clang) and
+// are the same as Switch on other compilers, and Jit only exists on x86-64
+// and aarch64 hosts that can map executable memory (it falls back to
+// Threaded). Aot runs native code generated by uxn_aot, if any was linked
+// in for the loaded ROM, and is Threaded otherwise.
+enum class Engine : u8 {
+  Switch,
+  Threaded,
+  Decoded,
+  Jit,
+  Aot
+};
+
+// An instruction budget for one engine run. The engine stops before the
+// instruction that would exceed it, and records where it stopped.
+struct Budget {
+  u32 left;
+  u16 pc = 0;
+  bool stopped = false;
+};
+
+// Totals kept by eval_for, so frontends can enforce and report a CPU budget
+// per frame.
+struct EvalCounters {
+  u64 instructions = 0; // run through eval_for
+  u32 suspended = 0;    // vectors cut short by their budget or deadline
+  u64 hooked = 0;       // routine calls run by a Hook instead
+};
+
+struct Uxn;
+
+// A native replacement for a library routine found in many ROMs (high-
+// level emulation). Defining one at namespace scope adds it to
+// `registered`; uxn_hle.cpp has the built-in ones. Uxn::reset looks for
+// `code` anywhere in the loaded ROM, and while Uxn::hle is on, a call that
+// lands on one of the copies runs `run` instead, as long as those bytes
+// still hash to `hash`. `run` gets the routine's address and must leave
+// `ram`, `dev` and the live part of both stacks as the routine would just
+// before its final JMP2r, which the caller then does. It may return false
+// to have the ROM code run after all, as long as it changed nothing.
+// Engines don't charge anything for a hooked call beyond the call itself.
+struct Hook {
+  const char* name;
+  const u8* code;
+  u16 length;
+  u64 hash;
+  bool (*run)(Uxn& u, u16 addr);
+  const Hook* next;
+
+  static const Hook* registered;
+
+  Hook(const char* name, const u8* code, u16 length, bool (*run)(Uxn&, u16))
+  : name(name), code(code), length(length), hash(hash_bytes(code, length)), run(run), next(registered) {
+    registered = this;
+  }
+};
+
+// Whether calls run hooks: Verify runs both the hook and the ROM code,
+// keeps what the ROM code did, and reports (then drops) hooks that
+// disagree with it through Uxn::hle_mismatch.
+enum class Hle : u8 {
+  Off,
+  On,
+  Verify
+};
+
+// Why a trace is worth a look (see Uxn::on_trace).
+enum class TraceReason : u8 {
+  Halt,     // the ROM wrote System/halt
+  Stack,    // a stack over- or underflowed
+  Request   // the ROM wrote System/debug
+};
+
+// Takes a trace as text (see Uxn::trace_dump), a line at a time.
+struct TraceOutput {
+  virtual void line(const char* text) = 0;
+};
+
+// The name of an opcode, such as "LIT2r" or "ADD2k", NUL-terminated.
+void opcode_name(u8 ins, char out[8]);
+// What a trace reason says in a trace's heading, such as "halted".
+const char* trace_reason_name(TraceReason why);
+
+#ifdef UXN_PROFILE
+// What a profiling build (UXN_PROFILE defined) counted while running one
+// vector, across all the times it ran. Ticks are Uxn::profile_clock units.
+struct VectorProfile {
+  u16 vector;
+  u64 entries = 0, instructions = 0, ticks = 0;
+  u64 opcodes[0x100] = {0};
+  u64 dei[0x100] = {0}, dei_ticks[0x100] = {0};
+  u64 deo[0x100] = {0}, deo_ticks[0x100] = {0};
+  u64 pcs[0x10000] = {0};
+
+  VectorProfile(u16 vector) : vector(vector) {}
+};
+
+// Per-vector profiles, in the order the vectors first ran. Once MAX_VECTORS
+// are in use, the last one also counts any other vector.
+struct Profile {
+  static constexpr u8 MAX_VECTORS = 32;
+  VectorProfile* vectors[MAX_VECTORS] = {0};
+  u8 used = 0;
+  VectorProfile* current = nullptr;
+
+  ~Profile() { clear(); }
+  void enter(u16 vector);
+  void clear();
+};
+#endif
+
+// Device state for snapshots goes through these, read back in the order
+// it was written (see Uxn::save_devices).
+struct StateWriter {
+  virtual void write(const void* data, u32 length) = 0;
+};
+
+struct StateReader {
+  virtual bool read(void* data, u32 length) = 0;
+};
+
+// Snapshots are in uxn_snapshot.hpp; Uxn only keeps one of its own to share
+// unchanged pages with the next, and deletes it through this.
+struct SnapshotBase {
+  virtual ~SnapshotBase() {}
+};
+
+class Snapshot;
+class DecodeCache;
+class Jit;
+struct AotRom;
+
 struct Uxn {
   const u8* boot_rom;
   u32 boot_rom_size;
   u8 ram[0x10001], dev[0x101];
   BankIndex1* banks;
+  DecodeCache* decoded;
+  Jit* jit;
   Stack wst, rst;
   bool initialized = false;
+  Engine engine = Engine::Threaded;
+  // The compiled ROM matching the loaded one, and whether its code is
+  // still what's in `ram`.
+  const AotRom* aot = nullptr;
+  bool aot_valid = false;
+  // Set before init (or reset) to look for hooked routines in the ROM.
+  Hle hle = Hle::Off;
+  // If nonzero, call_vec runs vectors through eval_for with this budget.
+  u32 vector_budget = 0;
+  // Where a vector cut short by eval_for continues, or 0. No other vector
+  // runs until it has finished.
+  u16 resume_pc = 0;
+  // Vectors called in the meantime, for devices that call each one only
+  // once (see queues_vector), with their ports as they were then. resume
+  // runs them in order once the suspended vector gets to BRK; more than
+  // MAX_QUEUED are dropped.
+  struct QueuedVector {
+    u8 d, ports[16];
+  };
+  static constexpr u32 MAX_QUEUED = 64;
+  QueuedVector queued[MAX_QUEUED];
+  u32 queued_count = 0;
+  EvalCounters counters;
+#ifdef UXN_PROFILE
+  // Profiling builds always run the Switch engine, which counts into this.
+  Profile profile;
+#endif
 
-  Uxn(const u8* rom, u32 rom_size) : boot_rom(rom), boot_rom_size(rom_size), banks(nullptr) {}
-  virtual ~Uxn() { if (banks) delete banks; }
+  Uxn(const u8* rom, u32 rom_size) : boot_rom(rom), boot_rom_size(rom_size), banks(nullptr), decoded(nullptr), jit(nullptr) {}
+  virtual ~Uxn() { if (banks) delete banks; decoded_release(); jit_release(); delete snapshot_base; trace_start(0); }
 
   virtual bool init();
+  // Puts memory back the way the ROM loaded it, only touching the pages
+  // that changed (so cached code for the rest is kept), and clears `dev`
+  // and the stacks. A soft reset keeps the zero page. init always starts
+  // over from scratch, so a different ROM can be loaded in between.
   virtual void reset(bool soft = false);
 
-  bool eval(u16 pc);
+  bool eval(u16 pc, Budget* budget = nullptr) {
+    trace_jump(pc, 0, wst.ptr, rst.ptr);
+    bool ran = eval_engine(pc, budget);
+    trace_stacks(wst.ptr, rst.ptr);
+    if (trace_faults) stack_wrapped();
+    return ran;
+  }
+  bool eval_engine(u16 pc, Budget* budget) {
+#ifdef UXN_PROFILE
+    return eval_switch(pc, budget);
+#endif
+    switch (engine) {
+      case Engine::Switch: return eval_switch(pc, budget);
+      case Engine::Decoded: return eval_decoded(pc, budget);
+      case Engine::Jit: return eval_jit(pc, budget);
+      case Engine::Aot: return eval_aot(pc, budget);
+      default: return eval_threaded(pc, budget);
+    }
+  }
+  bool eval_switch(u16 pc, Budget* budget = nullptr);
+  bool eval_threaded(u16 pc, Budget* budget = nullptr);
+  bool eval_decoded(u16 pc, Budget* budget = nullptr);
+  bool eval_jit(u16 pc, Budget* budget = nullptr);
+  bool eval_aot(u16 pc, Budget* budget = nullptr);
+
+  // Runs from `pc` until BRK, at most `budget` instructions, checking
+  // past_deadline() every DEADLINE_SLICE instructions. If it has to stop
+  // early, the pc to continue from is left in resume_pc.
+  bool eval_for(u16 pc, u32 budget);
+  // Carries on with the suspended vector, then the ones queued behind it.
+  bool resume(u32 budget) {
+    if (!resume_pc) return false;
+    eval_for(resume_pc, budget);
+    run_queued();
+    return true;
+  }
+  bool suspended() const { return resume_pc; }
+  virtual bool past_deadline() { return false; }
+  // Called around each eval_for that runs, with the instructions it took
+  // and whether it got to BRK (eval on its own isn't watched).
+  virtual void before_run(u16 pc) {}
+  virtual void after_run(u16 pc, u32 instructions, bool finished) {}
+#ifdef UXN_PROFILE
+  // A monotonic clock for the profile's ticks; none by default.
+  virtual u64 profile_clock() { return 0; }
+#endif
+  static constexpr u32 DEADLINE_SLICE = 0x10000;
+
+  // Whether vector `d` is queued when it's called while another is
+  // suspended, rather than dropped. Devices that keep calling theirs
+  // until it runs, like the screen each frame, needn't queue it.
+  virtual bool queues_vector(u8 d) { return false; }
+
+  // A vector called while the reset vector is still suspended is queued
+  // even if the ROM hasn't set it yet: it may have by the time it runs.
   bool call_vec(u8 d) {
+    if (resume_pc) {
+      if (queues_vector(d)) queue_vec(d);
+      return false;
+    }
     u16 addr = peek2(dev + d);
-    return addr ? eval(addr) : false;
+    if (!addr) return false;
+#ifdef UXN_PROFILE
+    if (!vector_budget) profile.enter(addr);
+#endif
+    return vector_budget ? eval_for(addr, vector_budget) : eval(addr);
   }
 
-  u8* bank(u16 index) {
-    if (index == 0) return ram;
-    if (!banks) banks = new BankIndex1;
-    return (*banks)[index << 8][index & 0xff].mem;
+  // Bank memory a page at a time: the byte at `addr` in bank `index` (0 is
+  // ram) and the rest of its 4 KB page. bank_write allocates the page if
+  // need be and counts it as written. Devices writing to ram through it
+  // must still call ram_written.
+  const u8* bank_read(u16 index, u16 addr);
+  u8* bank_write(u16 index, u16 addr);
+  // Bytes allocated for banks: the pages written so far and their tables.
+  size_t bank_memory() const;
+
+  // Captures the whole machine, sharing the pages that haven't changed
+  // with the last snapshot taken or restored. restore puts it back, and
+  // fails (leaving the machine half restored) if the device state doesn't
+  // fit, say because the screen can't be resized. See uxn_snapshot.hpp.
+  Snapshot* snapshot();
+  bool restore(const Snapshot& s);
+  // Devices with state beyond `dev` save and load it here.
+  virtual void save_devices(StateWriter& out) {}
+  virtual bool load_devices(StateReader& in) { return true; }
+
+  // Keeps the last `entries` (rounded down to a power of two) jumps and
+  // device writes, or stops with 0. Engines store an entry at every
+  // vector start and after every jump, call, return and conditional, with
+  // an unconditional write (into a one-entry scratch ring when not
+  // tracing), so a trace costs next to nothing and can stay on; the
+  // instructions in between are read back from `ram` when it's dumped.
+  // Code the Jit compiled natively only shows where vectors started and
+  // what they wrote to devices.
+  void trace_start(u32 entries);
+  bool tracing() const { return trace_ring != &trace_scratch; }
+  // Writes out the trace, oldest first: each instruction's address and
+  // name, the stack pointers after each jump, and each device write.
+  void trace_dump(TraceOutput& out) const;
+  // Called while tracing when the trace is worth a look: the ROM halted
+  // or wrote System/debug, or a stack wrapped around (reported once per
+  // reset).
+  virtual void on_trace(TraceReason why) {}
+
+  // For the engines: after a control instruction `ins` (or 0 at the start
+  // of a run) has moved the pc to `to`, and before a DEO's write to `port`
+  // goes to the device. A stack pointer that crossed 0/0xff since the last
+  // jump counts as a wrapped stack.
+  void trace_jump(u16 to, u8 ins, u8 wp, u8 rp) {
+    trace_stacks(wp, rp);
+    trace_ring[trace_next++ & trace_mask] = to | ins << 16 | static_cast<u64>(wp) << 24 | static_cast<u64>(rp) << 32;
+  }
+  void trace_deo(u8 port) {
+    trace_ring[trace_next++ & trace_mask] = static_cast<u64>(port) << 16 | static_cast<u64>(dev[port]) << 24 | TRACE_DEO;
+  }
+  // Devices that set a stack pointer themselves call this after.
+  void trace_rebase() { trace_wp = wst.ptr, trace_rp = rst.ptr; }
+
+  // Devices must call this after writing to `ram` themselves, so engines
+  // that cache translated code can drop whatever was overwritten.
+  void ram_written(u16 addr, u32 length) {
+    if (decoded) decoded_invalidate(addr, length);
+    if (jit) jit_invalidate(addr, length);
+    if (aot_valid) aot_invalidate(addr, length);
   }
 
   Slice null_terminated_string_in_ram(u16 addr) const {
@@ -101,11 +426,64 @@ struct Uxn {
     return { ram + addr, addr + length > 0xffff ? static_cast<u16>(0x10000 - addr) : length };
   }
 
+  // Whether there is a hooked routine at `addr`. If so, hle_call runs it
+  // and sets `pc` to where it returns, or returns false and leaves the
+  // ROM code to run. Both stacks must be up to date in `wst`/`rst`.
+  bool hle_at(u16 addr) const { return hle_map[addr >> 3] >> (addr & 7) & 1; }
+  bool hle_call(u16& pc);
+  virtual void hle_mismatch(const Hook& hook, u16 addr) {}
+
   virtual void before_dei(u8 d) = 0;
   virtual void after_deo(u8 d) = 0;
 
+  static constexpr u8 HLE_SITES = 32;
+
 protected:
   Uxn() : Uxn(nullptr, 0) {}
+
+  void decoded_invalidate(u16 addr, u32 length);
+  void decoded_release();
+  void jit_invalidate(u16 addr, u32 length);
+  void jit_release();
+  void aot_reset();
+  void aot_invalidate(u16 addr, u32 length);
+  void hle_reset();
+  void stack_wrapped();
+
+private:
+  static constexpr u64 TRACE_DEO = 1ull << 40;
+  u64* trace_ring = &trace_scratch;
+  u32 trace_mask = 0, trace_next = 0;
+  u64 trace_scratch = 0;
+  u8 trace_wp = 0, trace_rp = 0, trace_faults = 0;
+  bool trace_reported = false;
+  SnapshotBase* snapshot_base = nullptr;
+  // The ROM and Hle mode memory and the engines' caches were last reset
+  // for; with anything else, reset drops the caches.
+  const u8* reset_rom = nullptr;
+  u32 reset_rom_size = 0;
+  Hle reset_hle = Hle::Off;
+
+  void queue_vec(u8 d);
+  void run_queued();
+  u8* bank_fault(Bank& b, u16 index, u8 p);
+  const u8* rom_page(u16 index, u8 p, u32& size) const;
+  void trace_stacks(u8 wp, u8 rp) {
+    trace_faults |= ((trace_wp + static_cast<s8>(wp - trace_wp)) | (trace_rp + static_cast<s8>(rp - trace_rp))) >> 8;
+    trace_wp = wp, trace_rp = rp;
+  }
+
+  struct HleSite {
+    u16 addr;
+    const Hook* hook;
+  };
+
+  u8 hle_map[0x2000] = {0}; // bit per address with an HleSite
+  HleSite hle_sites[HLE_SITES];
+  u8 hle_sites_used = 0;
+
+  bool hle_verify(const Hook& hook, u16& pc);
+  u16 hle_step(u16 pc, u8 rp, bool& returned);
 };
 
 }
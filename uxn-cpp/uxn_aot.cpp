@@ -0,0 +1,87 @@
+#include "uxn_aot.hpp"
+
+// Dispatch loop for ROMs compiled ahead of time (see uxn_aot.hpp and
+// aot_compiler.cpp).
+
+namespace uxn {
+
+const AotRom* AotRom::registered = nullptr;
+
+namespace {
+
+using Handler = bool (*)(Uxn&, AotRegs&);
+
+template <u8 ins>
+bool handler(Uxn& u, AotRegs& c) {
+  return aot::step<ins>(u, c);
+}
+
+#define ROW(F, h) \
+  F(h##0) F(h##1) F(h##2) F(h##3) F(h##4) F(h##5) F(h##6) F(h##7) \
+  F(h##8) F(h##9) F(h##a) F(h##b) F(h##c) F(h##d) F(h##e) F(h##f)
+#define OPCODES(F) \
+  ROW(F, 0) ROW(F, 1) ROW(F, 2) ROW(F, 3) ROW(F, 4) ROW(F, 5) ROW(F, 6) ROW(F, 7) \
+  ROW(F, 8) ROW(F, 9) ROW(F, a) ROW(F, b) ROW(F, c) ROW(F, d) ROW(F, e) ROW(F, f)
+#define HANDLER(x) &handler<0x##x>,
+
+constexpr Handler handlers[0x100] = { OPCODES(HANDLER) };
+
+}
+
+void Uxn::aot_reset() {
+  aot = nullptr;
+  aot_valid = false;
+  if (!AotRom::registered) return;
+  u64 hash = aot_hash(boot_rom, boot_rom_size);
+  for (const AotRom* r = AotRom::registered; r; r = r->next) {
+    if (r->size == boot_rom_size && r->hash == hash) {
+      aot = r, aot_valid = true;
+      return;
+    }
+  }
+}
+
+void Uxn::aot_invalidate(u16 addr, u32 length) {
+  if (length > 0x10000) length = 0x10000;
+  for (u32 i = 0; i < length; i++) {
+    u16 a = addr + i;
+    if (aot->opcodes[a >> 3] >> (a & 7) & 1) {
+      aot_valid = false;
+      return;
+    }
+  }
+}
+
+bool Uxn::eval_aot(u16 pc, Budget* budget) {
+  if (!initialized || !pc || dev[0x0f]) return 0;
+  if (!aot_valid) return eval_threaded(pc, budget);
+  AotRegs c = { ram, dev, wst.dat, rst.dat, aot->opcodes, budget ? budget->left : ~0u, wst.ptr, rst.ptr, pc };
+  for (;;) {
+    u32 next = aot->run(*this, c);
+    if (next == AOT_BRK) break;
+    c.pc = next;
+    if (!aot_valid) {
+      // Code was overwritten; finish this vector (and every later one)
+      // in the threaded engine.
+      c.sync(*this);
+      if (budget) budget->left = c.left;
+      return eval_threaded(c.pc, budget);
+    }
+    if (next & (AOT_STOP | AOT_MISS)) {
+      if (!c.left) {
+        if (budget) {
+          budget->pc = c.pc, budget->stopped = true;
+          break;
+        }
+        c.left = ~0u;
+      }
+      c.left--;
+      if (!handlers[c.ram[c.pc++]](*this, c)) break;
+    }
+  }
+  c.sync(*this);
+  if (budget) budget->left = c.left;
+  return 1;
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "uxn.hpp"
+
+// Runtime support for ROMs compiled ahead of time by uxn_aot.
+//
+// uxn_aot turns a ROM into C++: one function per code region, where a
+// region is a routine plus everything it reaches through static jumps
+// (which become gotos). Calls, returns and other computed jumps go back
+// through a generated `switch` over every labelled address. Instructions
+// run through the same `step` template as the interpreters, with the pc
+// set to a constant before each one, so the compiler folds the decoding
+// away and only the stack and memory traffic is left.
+//
+// Generated code only depends on the ROM's opcode bytes: immediates are
+// read from `ram` at run time, so patching a literal is fine. Overwriting
+// an opcode byte (from the CPU, or a device through Uxn::ram_written)
+// drops the compiled ROM until the next reset, and the threaded engine
+// carries on from there. Addresses the static pass never saw run one
+// instruction at a time through the same handlers.
+//
+// This header is only meant for uxn_aot.cpp and generated files; it
+// defines the short stack macros at file scope.
+
+namespace uxn {
+
+// What a region or the dispatcher returns: the pc to continue from, or one
+// of these (or'd with the pc for STOP and MISS).
+static constexpr u32 AOT_BRK = 0x10000, AOT_STOP = 0x20000, AOT_MISS = 0x40000;
+
+struct AotRegs {
+  u8 *ram, *dev, *wd, *rd;
+  const u8* opcodes; // bit per address that holds a compiled opcode
+  u32 left;          // instruction budget
+  u8 wp, rp;
+  u16 pc;
+
+  void sync(Uxn& u) const { u.wst.ptr = wp; u.rst.ptr = rp; }
+  void load(const Uxn& u) { wp = u.wst.ptr; rp = u.rst.ptr; }
+  bool is_code(u16 a) const { return opcodes[a >> 3] >> (a & 7) & 1; }
+};
+
+// One compiled ROM. Generated files define one of these at namespace
+// scope, which adds it to `registered`; Uxn::reset picks the one whose
+// hash and size match the loaded ROM.
+struct AotRom {
+  const char* name;
+  u64 hash; // aot_hash of the ROM file
+  u32 size;
+  const u8* opcodes;
+  // Runs compiled code from `c.pc`; returns the next pc, AOT_BRK, or
+  // AOT_STOP/AOT_MISS with the pc of an instruction it couldn't run.
+  u32 (*run)(Uxn& u, AotRegs& c);
+  const AotRom* next;
+
+  static const AotRom* registered;
+
+  AotRom(const char* name, u64 hash, u32 size, const u8* opcodes, u32 (*run)(Uxn&, AotRegs&))
+  : name(name), hash(hash), size(size), opcodes(opcodes), run(run), next(registered) {
+    registered = this;
+  }
+};
+
+// Over the whole ROM file.
+static inline u64 aot_hash(const u8* rom, u32 size) {
+  return hash_bytes(rom, size);
+}
+
+namespace aot {
+
+#define T *(s + *p)
+#define N *(s + (u8)(*p - 1))
+#define L *(s + (u8)(*p - 2))
+#define X *(s + (u8)(*p - 3))
+#define Y *(s + (u8)(*p - 4))
+#define Z *(s + (u8)(*p - 5))
+#define T2 (N << 8 | T)
+#define H2 (L << 8 | N)
+#define N2 (X << 8 | L)
+#define L2 (Z << 8 | Y)
+#define T2_(v) { r = (v); T = r; N = r >> 8; }
+#define N2_(v) { r = (v); L = r; X = r >> 8; }
+#define L2_(v) { r = (v); Y = r; Z = r >> 8; }
+#define FLIP      { s = R ? c.wd : c.rd; p = R ? &c.wp : &c.rp; }
+#define SHIFT(y)  { *p += (y); }
+#define SET(x, y) { SHIFT(K ? x + y : y) }
+
+#define DEI(d)    { c.sync(u); u.before_dei(d); c.load(u); }
+#define DEO(d)    { u8 _d = (d); c.sync(u); u.trace_deo(_d); u.after_deo(_d); c.load(u); }
+#define BRK       return false
+#define STORED(a) { if (c.is_code(a)) u.aot_valid = false; }
+#define CALLED    { if (u.hle_at(pc)) { c.sync(u); u.hle_call(pc); c.load(u); } }
+#define JUMPED    u.trace_jump(pc, ins, c.wp, c.rp)
+
+// Runs one instruction with `c.pc` just past its opcode; returns false on
+// BRK.
+template <u8 ins>
+[[gnu::always_inline]] inline bool step(Uxn& u, AotRegs& c) {
+  constexpr bool K = ins & 0x80, R = ins & 0x40;
+  u8 *s = R ? c.rd : c.wd, *p = R ? &c.rp : &c.wp;
+  u8 *ram = c.ram, *dev = c.dev, *rr;
+  u16 &pc = c.pc, t, n, l, r;
+  switch(ins & 0x3f) {
+#include "uxn_ops.hpp"
+  }
+  return true;
+}
+
+}
+
+}
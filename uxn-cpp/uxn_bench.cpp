@@ -0,0 +1,286 @@
+#include "headless_varvara.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <new>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Runs ROMs with no window, feeding each the same scripted input for a
+   fixed number of frames, and prints timings as JSON:
+
+     uxn_bench [-frames N] [-switch|-threaded|-decoded|-jit|-aot] [-hle] [-zoom N] [rom...]
+
+   With no ROMs it runs every .rom in UXN_BENCH_ROMS. Each ROM's own
+   directory is its sandbox, and every run starts at the same virtual time.
+   The checksums at the end of each result show whether a change to the
+   emulator changed what the ROM did, not just how fast it did it.
+
+   -zoom N also scales each repaint's rectangles up N times into a second
+   framebuffer with scale_rect, as the Pi frontend does, and times that
+   apart; the zoomed checksum shows whether the scaler's output changed. */
+
+/* Allocation totals, for the memory each ROM run needs. */
+static size_t live_bytes = 0, peak_bytes = 0;
+
+void* operator new(size_t size) {
+  size_t* p = static_cast<size_t*>(malloc(size + sizeof(max_align_t)));
+  if (!p) abort();
+  *p = size;
+  live_bytes += size;
+  if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+  return reinterpret_cast<u8*>(p) + sizeof(max_align_t);
+}
+
+void operator delete(void* ptr) noexcept {
+  if (!ptr) return;
+  size_t* p = reinterpret_cast<size_t*>(static_cast<u8*>(ptr) - sizeof(max_align_t));
+  live_bytes -= *p;
+  free(p);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+namespace uxn {
+
+using Clock = std::chrono::steady_clock;
+
+static u64 elapsed_ns(Clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count();
+}
+
+static u64 fnv(u64 h, const u8* d, size_t length) {
+  for (size_t i = 0; i < length; i++) h = (h ^ d[i]) * 0x100000001b3ull;
+  return h;
+}
+
+/* Keeps the console output for its checksum, and times the screen vector
+   apart from the repaint, and the repaint apart from scaling it. */
+class BenchVarvara : public HeadlessVarvara {
+public:
+  std::ostringstream output;
+  const u8 zoom;
+  // From malloc, so the memory totals are the same with -zoom as without.
+  u32* zoomed = nullptr;
+  size_t zoomed_size = 0;
+
+  BenchVarvara(const std::filesystem::path& rom, u8 zoom)
+  : HeadlessVarvara(640, 480, rom.parent_path().c_str(), nullptr, output),
+    zoom(zoom), rom_name(rom.filename().string()) {
+    boot_rom_filename = rom_name.c_str();
+  }
+  ~BenchVarvara() { free(zoomed); }
+
+  void script(u32 frame);
+  // zoom_ns is left alone if nothing was repainted.
+  void timed_frame(u64& vector_ns, u64& redraw_ns, u64& zoom_ns) {
+    auto start = Clock::now();
+    call_vec(0x20);
+    vector_ns = elapsed_ns(start);
+    screen.last_paint_count = 0;
+    start = Clock::now();
+    screen.present();
+    redraw_ns = elapsed_ns(start);
+    if (zoom > 1 && screen.last_paint_count) {
+      start = Clock::now();
+      scale();
+      zoom_ns = elapsed_ns(start);
+    }
+    datetime.advance(FRAME_US);
+  }
+  u64 screen_hash() const {
+    return fnv(0xcbf29ce484222325ull, reinterpret_cast<const u8*>(framebuffer()), width() * height() * sizeof(u32));
+  }
+  // Scales the last repaint into `zoomed`, or the whole screen if the ROM
+  // has resized it.
+  void scale() {
+    u32 w = width(), zoomed_w = w * zoom;
+    Screen::Rect all = { 0, 0, width(), height() };
+    const Screen::Rect* rects = screen.last_paint;
+    u32 count = screen.last_paint_count;
+    if (zoomed_size != w * height() * zoom * zoom) {
+      zoomed_size = w * height() * zoom * zoom;
+      zoomed = static_cast<u32*>(realloc(zoomed, zoomed_size * sizeof(u32)));
+      if (!zoomed) abort();
+      rects = &all, count = 1;
+    }
+    for (u32 i = 0; i < count; i++) {
+      const Screen::Rect& r = rects[i];
+      scale_rect<sizeof(u32)>(reinterpret_cast<u8*>(&zoomed[r.y * zoom * zoomed_w + r.x * zoom]), zoomed_w * sizeof(u32),
+                              reinterpret_cast<const u8*>(framebuffer() + r.y * w + r.x), w * sizeof(u32),
+                              r.w, r.h, zoom);
+    }
+  }
+  u64 zoomed_hash() const {
+    return fnv(0xcbf29ce484222325ull, reinterpret_cast<const u8*>(zoomed), zoomed_size * sizeof(u32));
+  }
+
+private:
+  std::string rom_name;
+};
+
+struct Stats {
+  std::vector<u64> samples;
+
+  u64 mean() const {
+    u64 total = 0;
+    for (u64 s : samples) total += s;
+    return samples.empty() ? 0 : total / samples.size();
+  }
+  u64 percentile(u32 p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[(samples.size() - 1) * p / 100];
+  }
+};
+
+struct Result {
+  u64 startup_ns = 0, startup_instructions = 0, cpu_ns = 0;
+  Stats screen_vector, redraw, zoom;
+  size_t peak_bytes = 0;
+  bool halted = false;
+};
+
+/* The input script: the mouse sweeps the screen and clicks, the buttons
+   take turns, keys are typed, and a line arrives on the console. It runs
+   all of these through the input vectors, before the frame's screen
+   vector. */
+void BenchVarvara::script(u32 frame) {
+  static constexpr Button buttons[] = { Button::Up, Button::Right, Button::Down, Button::Left, Button::A, Button::B };
+  static constexpr char keys[] = "uxn bench ";
+  u16 w = width(), h = height();
+  input.mouse_move(frame * 3 % w, (frame * 7 + h / 4) % h);
+  if (frame % 30 == 0) input.mouse_down(MouseButton::Left);
+  if (frame % 30 == 2) input.mouse_up(MouseButton::Left);
+  Button b = buttons[frame / 20 % (sizeof(buttons) / sizeof(buttons[0]))];
+  if (frame % 20 == 5) input.button_down(b);
+  if (frame % 20 == 8) input.button_up(b);
+  if (frame % 25 == 12) {
+    char c = keys[frame / 25 % (sizeof(keys) - 1)];
+    input.key_down(c);
+    input.key_up(c);
+  }
+  if (frame == 60) for (const char* c = "bench\n"; *c; c++) console.read_byte(*c, ConsoleType::Stdin);
+}
+
+static bool run(BenchVarvara& v, u32 frames, Result& r) {
+  size_t base_bytes = live_bytes;
+  peak_bytes = live_bytes;
+  /* Vectors go through eval_for, which counts instructions, and never
+     run out of budget. */
+  v.vector_budget = ~0u;
+  auto start = Clock::now();
+  if (!v.init()) return false;
+  r.startup_ns = elapsed_ns(start);
+  if (v.zoom > 1) v.scale();
+  r.startup_instructions = v.counters.instructions;
+  r.screen_vector.samples.reserve(frames);
+  r.redraw.samples.reserve(frames);
+  for (u32 f = 0; f < frames && !v.dev[0x0f]; f++) {
+    start = Clock::now();
+    v.script(f);
+    r.cpu_ns += elapsed_ns(start);
+    u64 vector_ns, redraw_ns, zoom_ns = 0;
+    v.timed_frame(vector_ns, redraw_ns, zoom_ns);
+    r.screen_vector.samples.push_back(vector_ns);
+    r.redraw.samples.push_back(redraw_ns);
+    if (zoom_ns) r.zoom.samples.push_back(zoom_ns);
+    r.cpu_ns += vector_ns;
+  }
+  r.halted = v.dev[0x0f];
+  r.peak_bytes = peak_bytes - base_bytes;
+  return true;
+}
+
+static void print_stats(const char* name, Stats& s) {
+  u64 mean = s.mean(), p99 = s.percentile(99), max = s.percentile(100);
+  printf("      \"%s\": { \"mean\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n", name, mean / 1e3, p99 / 1e3, max / 1e3);
+}
+
+static void print_result(const std::string& rom, BenchVarvara& v, Result& r, bool first) {
+  u64 cpu_ns = r.cpu_ns ? r.cpu_ns : 1, ran = v.counters.instructions - r.startup_instructions;
+  printf("%s\n    {\n      \"rom\": \"%s\",\n      \"frames\": %zu, \"halted\": %s,\n",
+         first ? "" : ",", rom.c_str(), r.screen_vector.samples.size(), r.halted ? "true" : "false");
+  printf("      \"instructions\": %llu, \"instructions_per_second\": %.0f,\n",
+         (unsigned long long)v.counters.instructions, ran * 1e9 / cpu_ns);
+  printf("      \"hooked_calls\": %llu,\n", (unsigned long long)v.counters.hooked);
+  printf("      \"startup_us\": %.1f,\n", r.startup_ns / 1e3);
+  print_stats("screen_vector_us", r.screen_vector);
+  print_stats("redraw_us", r.redraw);
+  if (v.zoom > 1) print_stats("zoom_us", r.zoom);
+  printf("      \"peak_allocated_bytes\": %zu, \"bank_bytes\": %zu,\n", r.peak_bytes, v.bank_memory());
+  std::string out = v.output.str();
+  printf("      \"console_bytes\": %zu,\n", out.size());
+  printf("      \"checksums\": { \"ram\": \"%016llx\", \"screen\": \"%016llx\", \"console\": \"%016llx\"",
+         (unsigned long long)fnv(0xcbf29ce484222325ull, v.ram, 0x10000), (unsigned long long)v.screen_hash(),
+         (unsigned long long)fnv(0xcbf29ce484222325ull, reinterpret_cast<const u8*>(out.data()), out.size()));
+  if (v.zoom > 1) printf(", \"zoomed\": \"%016llx\"", (unsigned long long)v.zoomed_hash());
+  printf(" }\n    }");
+}
+
+}
+
+int main(int argc, char** argv) {
+  using namespace uxn;
+  u32 frames = 600;
+  Engine engine = Engine::Threaded;
+  const char* engine_name = "threaded";
+  Hle hle = Hle::Off;
+  u8 zoom = 1;
+  std::vector<std::filesystem::path> roms;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-frames") && i + 1 < argc) frames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-switch")) engine = Engine::Switch, engine_name = "switch";
+    else if (!strcmp(argv[i], "-threaded")) engine = Engine::Threaded, engine_name = "threaded";
+    else if (!strcmp(argv[i], "-decoded")) engine = Engine::Decoded, engine_name = "decoded";
+    else if (!strcmp(argv[i], "-jit")) engine = Engine::Jit, engine_name = "jit";
+    else if (!strcmp(argv[i], "-aot")) engine = Engine::Aot, engine_name = "aot";
+    else if (!strcmp(argv[i], "-hle")) hle = Hle::On;
+    else if (!strcmp(argv[i], "-zoom") && i + 1 < argc && atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= 8)
+      zoom = atoi(argv[++i]);
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-frames N] [-switch|-threaded|-decoded|-jit|-aot] [-hle] [-zoom N] [rom...]\n",
+              argv[0]);
+      return 1;
+    } else roms.push_back(std::filesystem::absolute(argv[i]));
+  }
+#ifdef UXN_BENCH_ROMS
+  if (roms.empty()) {
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(UXN_BENCH_ROMS, ec))
+      if (entry.path().extension() == ".rom") roms.push_back(entry.path());
+    std::sort(roms.begin(), roms.end());
+  }
+#endif
+  if (roms.empty()) {
+    fprintf(stderr, "%s: no ROMs to run\n", argv[0]);
+    return 1;
+  }
+
+  printf("{\n  \"engine\": \"%s\", \"hle\": %s, \"frames\": %u, \"zoom\": %u,\n  \"results\": [",
+         engine_name, hle == Hle::On ? "true" : "false", frames, zoom);
+  bool first = true;
+  int failed = 0;
+  for (auto& rom : roms) {
+    BenchVarvara* v = new BenchVarvara(rom, zoom);
+    v->engine = engine;
+    v->hle = hle;
+    Result r;
+    if (run(*v, frames, r)) {
+      print_result(rom.filename().string(), *v, r, first);
+      first = false;
+    } else {
+      fprintf(stderr, "%s: could not start %s\n", argv[0], rom.c_str());
+      failed++;
+    }
+    delete v;
+  }
+  printf("\n  ]\n}\n");
+  return failed ? 1 : 0;
+}
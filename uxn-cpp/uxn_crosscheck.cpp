@@ -0,0 +1,172 @@
+#include "headless_varvara.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Runs ROMs headless under every engine with the same scripted input, and
+   checks that they all do what Switch does, frame by frame: where each
+   cut-short vector stopped and how many instructions ran, then the memory,
+   screen and console at the end. Each ROM runs without a budget and with
+   small ones, so vectors get suspended all over the place:
+
+     uxn_crosscheck [-frames N] [-hle] [rom...]
+
+   With no ROMs it runs every .rom in UXN_BENCH_ROMS. Aot only runs
+   compiled code for ROMs built in with UXN_AOT_ROMS. Every run gets an
+   empty directory of its own as its sandbox, so files one run writes
+   don't change the next. Prints each disagreement, and exits with 1 if
+   there were any. */
+
+namespace uxn {
+
+static constexpr u32 BUDGETS[] = { ~0u, 100000, 5000, 100 };
+static constexpr struct {
+  Engine engine;
+  const char* name;
+} ENGINES[] = {
+  { Engine::Switch, "switch" }, { Engine::Threaded, "threaded" }, { Engine::Decoded, "decoded" },
+  { Engine::Jit, "jit" }, { Engine::Aot, "aot" },
+};
+
+static u64 fnv(u64 h, const void* data, size_t length) {
+  const u8* d = static_cast<const u8*>(data);
+  for (size_t i = 0; i < length; i++) h = (h ^ d[i]) * 0x100000001b3ull;
+  return h;
+}
+
+// What one run did: a hash per frame, and checksums of how it ended.
+struct Run {
+  std::vector<u64> frames;
+  u64 ram = 0, screen = 0, console = 0;
+};
+
+class CheckVarvara : public HeadlessVarvara {
+public:
+  std::ostringstream output;
+
+  CheckVarvara(const char* dir, const std::vector<u8>& rom)
+  : HeadlessVarvara(640, 480, dir, rom.data(), rom.size(), output) {}
+
+  // The mouse sweeps and clicks, buttons and keys take turns, and a line
+  // comes in on the console; the ROM sees all of it before the frame.
+  void script(u32 frame) {
+    static constexpr Button buttons[] = { Button::Up, Button::Right, Button::Down, Button::Left, Button::A, Button::B };
+    u16 w = width(), h = height();
+    input.mouse_move(frame * 5 % w, (frame * 3 + h / 3) % h);
+    if (frame % 24 == 0) input.mouse_down(MouseButton::Left);
+    if (frame % 24 == 3) input.mouse_up(MouseButton::Left);
+    Button b = buttons[frame / 16 % (sizeof(buttons) / sizeof(buttons[0]))];
+    if (frame % 16 == 4) input.button_down(b);
+    if (frame % 16 == 7) input.button_up(b);
+    if (frame % 20 == 10) {
+      input.key_down('a' + frame % 26);
+      input.key_up('a' + frame % 26);
+    }
+    if (frame == 50) for (const char* c = "check\n"; *c; c++) console.read_byte(*c, ConsoleType::Stdin);
+  }
+};
+
+static bool run(const std::vector<u8>& rom, Engine engine, Hle hle, u32 budget, u32 frames, Run& r) {
+  auto dir = std::filesystem::temp_directory_path() / "uxn_crosscheck";
+  std::error_code ec;
+  std::filesystem::remove_all(dir, ec);
+  std::filesystem::create_directories(dir, ec);
+  CheckVarvara v(dir.c_str(), rom);
+  v.engine = engine;
+  v.hle = hle;
+  v.vector_budget = budget;
+  if (!v.init()) return false;
+  for (u32 f = 0; f < frames && !v.halted(); f++) {
+    v.script(f);
+    v.step_frame();
+    u64 state[] = { v.resume_pc, v.counters.instructions, v.counters.suspended };
+    r.frames.push_back(fnv(0xcbf29ce484222325ull, state, sizeof(state)));
+  }
+  std::string out = v.output.str();
+  r.ram = fnv(0xcbf29ce484222325ull, v.ram, 0x10000);
+  r.screen = fnv(0xcbf29ce484222325ull, v.framebuffer(), v.width() * v.height() * sizeof(u32));
+  r.console = fnv(0xcbf29ce484222325ull, out.data(), out.size());
+  std::filesystem::remove_all(dir, ec);
+  return true;
+}
+
+// Prints how `r` differs from `ref`, if it does.
+static bool agree(const std::string& rom, const char* engine, u32 budget, const Run& ref, const Run& r) {
+  const char* what = nullptr;
+  size_t frame = 0;
+  for (; frame < ref.frames.size() && frame < r.frames.size() && ref.frames[frame] == r.frames[frame]; frame++) {}
+  if (frame < ref.frames.size() || frame < r.frames.size()) what = "instructions or suspension";
+  else if (r.ram != ref.ram) what = "memory";
+  else if (r.screen != ref.screen) what = "screen";
+  else if (r.console != ref.console) what = "console output";
+  if (!what) return true;
+  printf("%s: %s differs from switch with budget %u, in %s", rom.c_str(), engine, budget, what);
+  if (frame < ref.frames.size() || frame < r.frames.size()) printf(" from frame %zu", frame);
+  printf("\n");
+  return false;
+}
+
+}
+
+int main(int argc, char** argv) {
+  using namespace uxn;
+  u32 frames = 300;
+  Hle hle = Hle::Off;
+  std::vector<std::filesystem::path> roms;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-frames") && i + 1 < argc) frames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-hle")) hle = Hle::On;
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-frames N] [-hle] [rom...]\n", argv[0]);
+      return 1;
+    } else roms.push_back(std::filesystem::absolute(argv[i]));
+  }
+#ifdef UXN_BENCH_ROMS
+  if (roms.empty()) {
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(UXN_BENCH_ROMS, ec))
+      if (entry.path().extension() == ".rom") roms.push_back(entry.path());
+    std::sort(roms.begin(), roms.end());
+  }
+#endif
+  if (roms.empty()) {
+    fprintf(stderr, "%s: no ROMs to run\n", argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for (auto& path : roms) {
+    std::ifstream f(path, std::ios::binary);
+    std::vector<u8> rom((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    std::string name = path.filename().string();
+    if (rom.empty()) {
+      fprintf(stderr, "%s: could not read %s\n", argv[0], path.c_str());
+      failed++;
+      continue;
+    }
+    u32 disagreed = 0;
+    for (u32 budget : BUDGETS) {
+      Run ref;
+      if (!run(rom, Engine::Switch, hle, budget, frames, ref)) {
+        fprintf(stderr, "%s: could not start %s\n", argv[0], path.c_str());
+        failed++;
+        break;
+      }
+      for (auto& e : ENGINES) {
+        if (e.engine == Engine::Switch) continue;
+        Run r;
+        if (!run(rom, e.engine, hle, budget, frames, r) || !agree(name, e.name, budget, ref, r)) disagreed++;
+      }
+    }
+    if (!disagreed) printf("%s: all engines agree\n", name.c_str());
+    failed += disagreed;
+  }
+  return failed ? 1 : 0;
+}
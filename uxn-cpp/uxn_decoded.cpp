@@ -0,0 +1,250 @@
+#include "uxn.hpp"
+
+// Pre-decoded Uxn engine.
+//
+// Each address is decoded once, on first execution, into a Cell: which
+// handler to run and its immediate (LIT/LIT2 values and JCI/JMI/JSI
+// offsets), so handlers never fetch operands. The most frequent
+// instruction pairs are fused into a single cell and handler. Every
+// handler knows how many bytes it covers, so advancing the pc doesn't wait
+// on a load. Cells cover at most MAX_CELL bytes, so a write to `ram`
+// clears the cells starting up to MAX_CELL - 1 bytes before it, and the
+// next dispatch there decodes the new bytes.
+//
+// Otherwise this works like the threaded engine: the same `step`
+// template, computed-goto dispatch and stack pointers cached in locals.
+
+namespace uxn {
+
+#if defined(__GNUC__)
+
+namespace {
+
+constexpr u8 MAX_CELL = 4;
+
+// Cell kinds: DECODE, then one per opcode, then one per fusion.
+constexpr u16 DECODE = 0, OPCODE = 1, FUSED = 0x101;
+
+// The fused pairs, as (first, second) opcode. These are the 32 most
+// frequent dynamic pairs over the ROMs in roms/ (weighting every ROM
+// equally), after leaving out pairs whose first instruction branches,
+// stores, reads the pc or calls a device, and pairs with two immediates.
+// Together they cover about 42% of executed instructions. LIT LIT (the
+// third most common pair) runs the LIT2 handler instead.
+#define FUSIONS(F) \
+  F(80, 0d) F(80, 17) F(80, 37) F(a0, 38) F(06, 80) F(80, 30) F(80, 3f) F(01, 8a) \
+  F(38, 80) F(80, 19) F(80, 1c) F(80, 04) F(80, 10) F(80, 08) F(06, 20) F(19, 06) \
+  F(04, 80) F(a0, 2e) F(80, 07) F(8a, 80) F(08, 80) F(80, 1f) F(30, 38) F(07, 80) \
+  F(1c, 80) F(38, 14) F(26, 80) F(3f, 80) F(1f, 80) F(8a, 20) F(80, 16)
+
+struct Fusion {
+  u8 first, second;
+};
+
+#define FUSION_ENTRY(a, b) { 0x##a, 0x##b },
+constexpr Fusion fusions[] = { FUSIONS(FUSION_ENTRY) };
+constexpr u16 LIT_LIT = FUSED + sizeof(fusions) / sizeof(*fusions), LITR_LITR = LIT_LIT + 1;
+
+constexpr u8 imm_length(u8 ins) {
+  if ((ins & 0xbf) == 0x80) return 1;
+  return (ins & 0xbf) == 0xa0 || ins == 0x20 || ins == 0x40 || ins == 0x60 ? 2 : 0;
+}
+
+struct Cell {
+  u16 kind;
+  u16 imm;
+};
+
+}
+
+class DecodeCache {
+public:
+  Cell cells[0x10000] = {};
+
+  void invalidate(u16 addr, u32 length) {
+    u32 n = length + MAX_CELL - 1;
+    if (n > 0x10000) n = 0x10000;
+    u16 a = addr - (MAX_CELL - 1);
+    for (u32 i = 0; i < n; i++) cells[static_cast<u16>(a + i)] = {};
+  }
+
+  void decode(const u8* ram, u16 pc) {
+    Cell& c = cells[pc];
+    u8 a = ram[pc];
+    u16 at = pc + 1;
+    c.kind = OPCODE + a;
+    c.imm = read_imm(ram, at, imm_length(a));
+    at += imm_length(a);
+    u8 b = ram[at];
+    if ((a & 0xbf) == 0x80 && b == a) {
+      c.kind = a == 0x80 ? LIT_LIT : LITR_LITR;
+      c.imm = c.imm << 8 | ram[static_cast<u16>(at + 1)];
+      return;
+    }
+    for (const Fusion& f : fusions) {
+      if (f.first != a || f.second != b) continue;
+      c.kind = FUSED + (&f - fusions);
+      if (imm_length(b)) c.imm = read_imm(ram, at + 1, imm_length(b));
+      return;
+    }
+  }
+
+private:
+  static u16 read_imm(const u8* ram, u16 at, u8 length) {
+    if (length == 1) return ram[at];
+    return length ? ram[at] << 8 | ram[static_cast<u16>(at + 1)] : 0;
+  }
+};
+
+namespace {
+
+struct Regs {
+  u8 *ram, *dev, *wd, *rd;
+  u8 wp, rp;
+  u16 pc;
+
+  void sync(Uxn& u) const { u.wst.ptr = wp; u.rst.ptr = rp; }
+  void load(const Uxn& u) { wp = u.wst.ptr; rp = u.rst.ptr; }
+};
+
+#define T *(s + *p)
+#define N *(s + (u8)(*p - 1))
+#define L *(s + (u8)(*p - 2))
+#define X *(s + (u8)(*p - 3))
+#define Y *(s + (u8)(*p - 4))
+#define Z *(s + (u8)(*p - 5))
+#define T2 (N << 8 | T)
+#define H2 (L << 8 | N)
+#define N2 (X << 8 | L)
+#define L2 (Z << 8 | Y)
+#define T2_(v) { r = (v); T = r; N = r >> 8; }
+#define N2_(v) { r = (v); L = r; X = r >> 8; }
+#define L2_(v) { r = (v); Y = r; Z = r >> 8; }
+#define FLIP      { s = R ? c.wd : c.rd; p = R ? &c.wp : &c.rp; }
+#define SHIFT(y)  { *p += (y); }
+#define SET(x, y) { SHIFT(K ? x + y : y) }
+
+#define DEI(d)    { c.sync(u); u.before_dei(d); c.load(u); }
+#define DEO(d)    { u8 _d = (d); c.sync(u); u.trace_deo(_d); u.after_deo(_d); c.load(u); }
+#define BRK       return false
+#define STORED(a) cache.invalidate(a, 1)
+#define CALLED    { if (u.hle_at(pc)) { c.sync(u); u.hle_call(pc); c.load(u); } }
+#define JUMPED    u.trace_jump(pc, ins, c.wp, c.rp)
+
+// Runs one instruction with `c.pc` already past its cell; returns false on
+// BRK. Immediates come from the cell instead of `ram`.
+template <u8 ins>
+[[gnu::always_inline]] inline bool step(Uxn& u, Regs& c, DecodeCache& cache, u16 imm) {
+  constexpr bool K = ins & 0x80, R = ins & 0x40;
+  u8 *s = R ? c.rd : c.wd, *p = R ? &c.rp : &c.wp;
+  u8 *ram = c.ram, *dev = c.dev, *rr;
+  u16 &pc = c.pc, t, n, l, r;
+  if constexpr ((ins & 0xbf) == 0x80) {        /* LIT  */
+    SHIFT(1) T = imm;
+  } else if constexpr ((ins & 0xbf) == 0xa0) { /* LIT2 */
+    SHIFT(2) T2_(imm)
+  } else if constexpr (ins == 0x20) {          /* JCI  */
+    t = T; SHIFT(-1) if (t) pc += imm; JUMPED;
+  } else if constexpr (ins == 0x40) {          /* JMI  */
+    pc += imm; JUMPED;
+  } else if constexpr (ins == 0x60) {          /* JSI  */
+    SHIFT(2) T2_(pc) pc += imm; CALLED; JUMPED;
+  } else {
+    switch(ins & 0x3f) {
+#include "uxn_ops.hpp"
+    }
+  }
+  return true;
+}
+
+}
+
+#define ROW(F, h) \
+  F(h##0) F(h##1) F(h##2) F(h##3) F(h##4) F(h##5) F(h##6) F(h##7) \
+  F(h##8) F(h##9) F(h##a) F(h##b) F(h##c) F(h##d) F(h##e) F(h##f)
+#define OPCODES(F) \
+  ROW(F, 0) ROW(F, 1) ROW(F, 2) ROW(F, 3) ROW(F, 4) ROW(F, 5) ROW(F, 6) ROW(F, 7) \
+  ROW(F, 8) ROW(F, 9) ROW(F, a) ROW(F, b) ROW(F, c) ROW(F, d) ROW(F, e) ROW(F, f)
+
+#define LABEL_ADDR(x) &&op_##x,
+#define FUSED_ADDR(a, b) &&fused_##a##_##b,
+#define SKIP(x) c.pc += 1 + imm_length(0x##x);
+#define RUN(x) if (!step<0x##x>(u, c, cache, imm)) goto brk;
+#define HANDLER(x) op_##x: COUNT SKIP(x) RUN(x) DISPATCH;
+#define FUSED_HANDLER(a, b) fused_##a##_##b: COUNT_PAIR(goto op_##a) SKIP(a) SKIP(b) RUN(a) RUN(b) DISPATCH;
+#define DISPATCH { \
+    const Cell& cell = cache.cells[c.pc]; \
+    imm = cell.imm; \
+    goto *table[cell.kind]; \
+  }
+// With one instruction of budget left, a fused cell runs only its first
+// instruction.
+#define COUNT if (Budgeted && !left--) goto out_of_budget;
+#define COUNT_PAIR(first) \
+  if constexpr (Budgeted) { \
+    if (left < 2) { if (!left) goto out_of_budget; first; } \
+    left -= 2; \
+  }
+
+namespace {
+
+// Not inlined or cloned: the label table must belong to the one copy.
+template <bool Budgeted>
+[[gnu::noinline, gnu::noclone]] void run(Uxn& u, DecodeCache& cache, u16 pc, Budget* budget) {
+  static void* const table[] = {
+    &&decode, OPCODES(LABEL_ADDR) FUSIONS(FUSED_ADDR) &&lit_lit, &&litr_litr
+  };
+  Regs c = { u.ram, u.dev, u.wst.dat, u.rst.dat, u.wst.ptr, u.rst.ptr, pc };
+  u32 left = Budgeted ? budget->left : 0;
+  u16 imm;
+  DISPATCH;
+decode:
+  cache.decode(u.ram, c.pc);
+  DISPATCH;
+  OPCODES(HANDLER)
+  FUSIONS(FUSED_HANDLER)
+lit_lit:
+  COUNT_PAIR({ imm >>= 8; goto op_80; }) SKIP(80) SKIP(80) RUN(a0) DISPATCH;
+litr_litr:
+  COUNT_PAIR({ imm >>= 8; goto op_c0; }) SKIP(c0) SKIP(c0) RUN(e0) DISPATCH;
+out_of_budget:
+  if constexpr (Budgeted) left = 0, budget->pc = c.pc, budget->stopped = true;
+brk:
+  if constexpr (Budgeted) budget->left = left;
+  c.sync(u);
+}
+
+}
+
+bool Uxn::eval_decoded(u16 pc, Budget* budget) {
+  if (!initialized || !pc || dev[0x0f]) return 0;
+  if (!decoded) decoded = new DecodeCache;
+  if (budget) run<true>(*this, *decoded, pc, budget);
+  else run<false>(*this, *decoded, pc, nullptr);
+  return 1;
+}
+
+void Uxn::decoded_invalidate(u16 addr, u32 length) {
+  decoded->invalidate(addr, length);
+}
+
+void Uxn::decoded_release() {
+  if (decoded) delete decoded;
+  decoded = nullptr;
+}
+
+#else
+
+class DecodeCache {};
+
+bool Uxn::eval_decoded(u16 pc, Budget* budget) {
+  return eval_switch(pc, budget);
+}
+
+void Uxn::decoded_invalidate(u16 addr, u32 length) {}
+
+void Uxn::decoded_release() {}
+
+#endif
+
+}
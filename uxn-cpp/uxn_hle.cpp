@@ -0,0 +1,263 @@
+#include "uxn.hpp"
+
+// High-level emulation of common library routines (see Hook in uxn.hpp).
+//
+// The built-in hooks cover the memory and string routines that ROMs built
+// with the usual Uxntal library share byte for byte. Each one checks the
+// stacks it needs and declines anything where the ROM code's behaviour
+// would depend on the order of its own reads and writes (overlapping
+// copies, writes over the routine itself, stack wraparound), so what's
+// left is a plain loop over `ram`.
+
+namespace uxn {
+
+const Hook* Hook::registered = nullptr;
+
+namespace {
+
+u16 get2(const Stack& s, u8 depth) {
+  return s.dat[static_cast<u8>(s.ptr - depth - 1)] << 8 | s.dat[static_cast<u8>(s.ptr - depth)];
+}
+
+void put2(Stack& s, u8 depth, u16 v) {
+  s.dat[static_cast<u8>(s.ptr - depth - 1)] = v >> 8;
+  s.dat[static_cast<u8>(s.ptr - depth)] = v;
+}
+
+// Whether [a, a + n) and [b, b + m) meet, wrapping around memory.
+bool overlap(u16 a, u32 n, u16 b, u32 m) {
+  return static_cast<u16>(b - a) < n || static_cast<u16>(a - b) < m;
+}
+
+// How many times a `do { p++ } while (end > p)` loop runs from `p`.
+u32 iterations(u16 p, u16 end) {
+  if (end > p) return end - p;
+  return p == 0xffff ? 1 + end : 1;
+}
+
+// The first address from `p` on that holds 0, or -1.
+s32 find_zero(const u8* ram, u16 p) {
+  for (u32 i = 0; i < 0x10000; i++, p++) if (!ram[p]) return p;
+  return -1;
+}
+
+// @mclr ( addr* len* -- )
+//   OVR2 ADD2 SWP2 &l STH2k #00 STH2r STA INC2 GTH2k ?&l POP2 POP2 JMP2r
+const u8 mclr_code[] = { 0x27, 0x38, 0x24, 0xaf, 0x80, 0x00, 0x6f, 0x15, 0x21, 0xaa, 0x80, 0xf6, 0x0d, 0x22, 0x22, 0x6c };
+
+bool mclr(Uxn& u, u16 at) {
+  if (u.wst.ptr < 4) return false;
+  u16 addr = get2(u.wst, 2);
+  u32 count = iterations(addr, addr + get2(u.wst, 0));
+  if (overlap(addr, count, at, sizeof(mclr_code))) return false;
+  for (u32 i = 0; i < count; i++) u.ram[static_cast<u16>(addr + i)] = 0;
+  u.ram_written(addr, count);
+  u.wst.ptr -= 4;
+  return true;
+}
+
+// @mcpy ( src* dst* len* -- )
+//   SWP2 STH2 OVR2 ADD2 SWP2 &l LDAk STH2kr STA INC2r INC2 GTH2k ?&l
+//   POP2 POP2 POP2r JMP2r
+const u8 mcpy_code[] = {
+  0x24, 0x2f, 0x27, 0x38, 0x24, 0x94, 0xef, 0x15, 0x61, 0x21, 0xaa, 0x20, 0xff, 0xf7, 0x22, 0x22, 0x62, 0x6c
+};
+
+bool mcpy(Uxn& u, u16 at) {
+  if (u.wst.ptr < 6) return false;
+  u16 src = get2(u.wst, 4), dst = get2(u.wst, 2);
+  u32 count = iterations(src, src + get2(u.wst, 0));
+  if (overlap(dst, count, src, count) || overlap(dst, count, at, sizeof(mcpy_code))) return false;
+  for (u32 i = 0; i < count; i++) u.ram[static_cast<u16>(dst + i)] = u.ram[static_cast<u16>(src + i)];
+  u.ram_written(dst, count);
+  u.wst.ptr -= 6;
+  return true;
+}
+
+// @scpy ( src* dst* -- )
+//   STH2 &w LDAk STH2kr STA INC2r INC2 LDAk ?&w POP2 #00 STH2r STA JMP2r
+const u8 scpy_code[] = { 0x2f, 0x94, 0xef, 0x15, 0x61, 0x21, 0x94, 0x80, 0xf7, 0x0d, 0x22, 0x80, 0x00, 0x6f, 0x15, 0x6c };
+
+bool scpy(Uxn& u, u16 at) {
+  if (u.wst.ptr < 4) return false;
+  u16 src = get2(u.wst, 2), dst = get2(u.wst, 0);
+  // The first byte is copied even if it's the terminator.
+  s32 end = find_zero(u.ram, src + 1);
+  if (end < 0 || end == src) return false;
+  u32 count = static_cast<u16>(end - src) + 1;
+  if (overlap(dst, count, src, count) || overlap(dst, count, at, sizeof(scpy_code))) return false;
+  for (u32 i = 0; i + 1 < count; i++) u.ram[static_cast<u16>(dst + i)] = u.ram[static_cast<u16>(src + i)];
+  u.ram[static_cast<u16>(dst + count - 1)] = 0;
+  u.ram_written(dst, count);
+  u.wst.ptr -= 4;
+  return true;
+}
+
+// @scap ( str* -- end* )
+//   LDAk #00 NEQ JMP JMP2r &w INC2 LDAk ?&w JMP2r
+const u8 scap_code[] = { 0x94, 0x80, 0x00, 0x09, 0x0c, 0x6c, 0x21, 0x94, 0x80, 0xfb, 0x0d, 0x6c };
+
+bool scap(Uxn& u, u16 at) {
+  if (u.wst.ptr < 2) return false;
+  s32 end = find_zero(u.ram, get2(u.wst, 0));
+  if (end < 0) return false;
+  put2(u.wst, 0, end);
+  return true;
+}
+
+// @snext ( str* -- next* ), past the end of a string that isn't empty
+//   &w INC2 LDAk ?&w INC2 JMP2r
+const u8 snext_code[] = { 0x21, 0x94, 0x80, 0xfb, 0x0d, 0x21, 0x6c };
+
+bool snext(Uxn& u, u16 at) {
+  if (u.wst.ptr < 2) return false;
+  s32 end = find_zero(u.ram, get2(u.wst, 0) + 1);
+  if (end < 0) return false;
+  put2(u.wst, 0, end + 1);
+  return true;
+}
+
+#define HOOK(name) const Hook name##_hook(#name, name##_code, sizeof(name##_code), name);
+HOOK(mclr)
+HOOK(mcpy)
+HOOK(scpy)
+HOOK(scap)
+HOOK(snext)
+
+}
+
+void Uxn::hle_reset() {
+  for (u8& b : hle_map) b = 0;
+  hle_sites_used = 0;
+  if (hle == Hle::Off) return;
+  u32 end = PAGE_PROGRAM + (boot_rom_size < 0x10000 - PAGE_PROGRAM ? boot_rom_size : 0x10000 - PAGE_PROGRAM);
+  for (const Hook* h = Hook::registered; h; h = h->next) {
+    for (u32 a = PAGE_PROGRAM; a + h->length <= end && hle_sites_used < HLE_SITES; a++) {
+      if (ram[a] != h->code[0] || hle_at(a) || hash_bytes(ram + a, h->length) != h->hash) continue;
+      hle_sites[hle_sites_used++] = { static_cast<u16>(a), h };
+      hle_map[a >> 3] |= 1 << (a & 7);
+    }
+  }
+}
+
+bool Uxn::hle_call(u16& pc) {
+  const Hook* hook = nullptr;
+  for (u8 i = 0; i < hle_sites_used && !hook; i++) if (hle_sites[i].addr == pc) hook = hle_sites[i].hook;
+  if (!hook || rst.ptr < 2 || hash_bytes(ram + pc, hook->length) != hook->hash) return false;
+  if (hle == Hle::Verify) return hle_verify(*hook, pc);
+  if (!hook->run(*this, pc)) return false;
+  pc = get2(rst, 0);
+  rst.ptr -= 2;
+  counters.hooked++;
+  return true;
+}
+
+// Verification is meant for tests, so it keeps it simple: full copies of
+// the machine state before and after the hook, then the ROM code runs
+// from the copy before and the results are compared.
+namespace {
+
+struct HleState {
+  u8 ram[0x10000], dev[0x100];
+  Stack wst, rst;
+  u16 pc;
+
+  void save(const Uxn& u, u16 at) {
+    for (u32 i = 0; i < 0x10000; i++) ram[i] = u.ram[i];
+    for (u32 i = 0; i < 0x100; i++) dev[i] = u.dev[i];
+    wst = u.wst, rst = u.rst, pc = at;
+  }
+  static bool live_equal(const Stack& a, const Stack& b) {
+    if (a.ptr != b.ptr) return false;
+    for (u32 i = 1; i <= a.ptr; i++) if (a.dat[i] != b.dat[i]) return false;
+    return true;
+  }
+  bool matches(const Uxn& u, u16 at) const {
+    if (pc != at || !live_equal(wst, u.wst) || !live_equal(rst, u.rst)) return false;
+    for (u32 i = 0; i < 0x10000; i++) if (ram[i] != u.ram[i]) return false;
+    for (u32 i = 0; i < 0x100; i++) if (dev[i] != u.dev[i]) return false;
+    return true;
+  }
+};
+
+}
+
+bool Uxn::hle_verify(const Hook& hook, u16& pc) {
+  HleState* before = new HleState;
+  HleState* native = new HleState;
+  before->save(*this, pc);
+  bool ran = hook.run(*this, pc);
+  if (ran) {
+    native->save(*this, get2(rst, 0));
+    native->rst.ptr -= 2;
+    for (u32 i = 0; i < 0x10000; i++) {
+      if (ram[i] == before->ram[i]) continue;
+      ram[i] = before->ram[i];
+      ram_written(i, 1);
+    }
+    for (u32 i = 0; i < 0x100; i++) dev[i] = before->dev[i];
+    wst = before->wst, rst = before->rst;
+  }
+  bool returned;
+  pc = hle_step(pc, rst.ptr, returned);
+  if (ran && (!returned || !native->matches(*this, pc))) {
+    hle_mismatch(hook, before->pc);
+    hle_map[before->pc >> 3] &= ~(1 << (before->pc & 7));
+  }
+  delete before;
+  delete native;
+  return true;
+}
+
+/* Registers
+[ Z ][ Y ][ X ][ L ][ N ][ T ] <
+[ . ][ . ][ . ][   H2   ][ . ] <
+[   L2   ][   N2   ][   T2   ] <
+*/
+
+#define T *(s->dat + s->ptr)
+#define N *(s->dat + (u8)(s->ptr - 1))
+#define L *(s->dat + (u8)(s->ptr - 2))
+#define X *(s->dat + (u8)(s->ptr - 3))
+#define Y *(s->dat + (u8)(s->ptr - 4))
+#define Z *(s->dat + (u8)(s->ptr - 5))
+#define T2 (N << 8 | T)
+#define H2 (L << 8 | N)
+#define N2 (X << 8 | L)
+#define L2 (Z << 8 | Y)
+#define T2_(v) { r = (v); T = r; N = r >> 8; }
+#define N2_(v) { r = (v); L = r; X = r >> 8; }
+#define L2_(v) { r = (v); Y = r; Z = r >> 8; }
+#define FLIP      { s = ins & 0x40 ? &wst : &rst; }
+#define SHIFT(y)  { s->ptr += (y); }
+#define SET(x, y) { SHIFT((ins & 0x80) ? x + y : y) }
+
+#define DEI(p)    before_dei(p)
+#define DEO(p)    { u8 d = (p); trace_deo(d); after_deo(d); }
+#define BRK       break
+#define STORED(a) ram_written(a, 1)
+#define CALLED    {}
+#define JUMPED    trace_jump(pc, ins, wst.ptr, rst.ptr)
+
+// Runs ROM code from `pc` until the JMP2r that takes the return stack
+// below `rp`, a BRK (which it doesn't run) or a few million instructions,
+// and returns the pc it stopped at.
+u16 Uxn::hle_step(u16 pc, u8 rp, bool& returned) {
+  u16 t, n, l, r;
+  u8 *ram = this->ram, *rr;
+  returned = false;
+  for (u32 steps = 0; steps < 0x1000000 && ram[pc]; steps++) {
+    u8 ins = ram[pc++];
+    Stack *s = ins & 0x40 ? &rst : &wst;
+    switch(ins & 0x3f) {
+#include "uxn_ops.hpp"
+    }
+    if (ins == 0x6c && rst.ptr == static_cast<u8>(rp - 2)) {
+      returned = true;
+      break;
+    }
+  }
+  return pc;
+}
+
+}
@@ -0,0 +1,806 @@
+#include "uxn.hpp"
+
+// Basic-block JIT for Uxn.
+//
+// Blocks are discovered lazily from whatever pc the engine is asked to run
+// (vector entry points, then every branch target reached from them), and
+// end at the first control transfer. Each block is translated into native
+// code and cached by address. Instructions without a native translation
+// (all of them on aarch64) call a handler with the instruction's pc passed
+// as an immediate; handlers are instantiated from the same opcode bodies
+// as the interpreters, so semantics (and DEI/DEO callouts) are identical.
+//
+// The JIT is built on x86-64. The aarch64 backend has yet to be built and
+// run, so it needs UXN_JIT_AARCH64; without it (or anywhere else) the Jit
+// engine runs Threaded.
+//
+// Only the opcode bytes of a block decide its translation: immediates (LIT
+// values and JCI/JMI/JSI offsets) are read from `ram` when executed, so
+// the common pattern of storing into a literal does not discard any code.
+// A store or device write that hits an opcode byte drops every block
+// containing it, and the running block returns to the dispatch loop right
+// after such a write. Pages that keep getting rewritten stop being
+// compiled, and are interpreted through the same handlers instead.
+//
+// Set UXN_PERF_MAP in the environment to write /tmp/perf-<pid>.map, so
+// `perf report` can attribute samples to ROM addresses.
+
+#if (defined(__x86_64__) && defined(__unix__)) || (defined(__aarch64__) && defined(__linux__) && defined(UXN_JIT_AARCH64))
+#define UXN_JIT 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace uxn {
+
+#ifdef UXN_JIT
+
+namespace {
+
+constexpr u32 BRK_PC = 0x10000;
+constexpr u32 MAX_BLOCK_OPS = 64, MAX_BLOCK_BYTES = MAX_BLOCK_OPS * 3;
+constexpr u32 MAX_BLOCKS = 0x4000;
+// Code buffers start at MIN_CODE and double, up to CODE_SIZE, as they fill.
+constexpr size_t MIN_CODE = 64 << 10, CODE_SIZE = 4 << 20, MAX_BLOCK_CODE = 256 + MAX_BLOCK_OPS * 256;
+constexpr u8 HOT_PAGE = 16;
+
+constexpr u8 op_length(u8 ins) {
+  return (ins & 0x1f) || !ins ? 1 : (ins & 0x80) && !(ins & 0x20) ? 2 : 3;
+}
+
+// BRK, JCI, JMI, JSI, JMP, JCN and JSR end a block.
+constexpr bool is_control(u8 ins) {
+  u8 op = ins & 0x1f;
+  return op ? op >= 0x0c && op <= 0x0e : !(ins & 0x80);
+}
+
+// JSI and JSR (not JSRr): the calls that can run a hook.
+constexpr bool is_call(u8 ins) {
+  return ins == 0x60 || ((ins & 0x1f) == 0x0e && !(ins & 0x40));
+}
+
+// Stores and device calls may overwrite translated code.
+constexpr bool may_write(u8 ins) {
+  u8 op = ins & 0x1f;
+  return op == 0x11 || op == 0x13 || op == 0x15 || op == 0x16 || op == 0x17;
+}
+
+using Handler = u32 (*)(Uxn*, u32);
+
+}
+
+class Jit {
+public:
+  bool ok = true; // false once the code buffer couldn't be mapped
+  u8 depth = 0;
+  u32 generation = 0;
+  u32 left = 0; // instruction budget; blocks that don't fit aren't entered
+  bool hooks = false; // whether the blocks compiled now leave calls to the handlers
+
+  // The code buffer isn't mapped until the first block is compiled, so
+  // instances that never get that far (or not far) cost little.
+  Jit() {
+    if (getenv("UXN_PERF_MAP")) {
+      char name[64];
+      snprintf(name, sizeof(name), "/tmp/perf-%d.map", getpid());
+      perf_map = fopen(name, "a");
+    }
+  }
+  ~Jit() {
+    if (code) munmap(code, code_size);
+    if (perf_map) fclose(perf_map);
+  }
+
+  bool is_code(u16 addr) const { return opcodes[addr]; }
+  bool is_hot(u16 pc) const { return hot[pc >> 8] >= HOT_PAGE; }
+
+  bool is_compiled(u16 pc) const { return entry[pc]; }
+
+  // Runs compiled blocks from `pc` until it reaches one that isn't
+  // compiled or doesn't fit in `left`; returns its address, or BRK_PC.
+  u32 run(Uxn& u, u32 pc);
+  bool compile(Uxn& u, u16 pc);
+  u32 interpret(Uxn& u, u16 pc);
+  void invalidate(Uxn& u, u16 addr, u32 length, bool opcodes_only);
+
+private:
+  struct Info {
+    u16 start;
+    u8 ops;
+  };
+
+  u8* code = nullptr;
+  size_t code_size = 0, code_base = 0, code_used = 0;
+  FILE* perf_map = nullptr;
+  Info infos[MAX_BLOCKS];
+  u32 infos_used = 0;
+  u16 index[0x10000] = {0};
+  u8* entry[0x10000] = {nullptr};
+  u8 opcodes[0x10000] = {0}; // nonzero where a block decoded an opcode
+  u8 hot[0x100] = {0};
+
+  void flush() {
+    for (u32 i = 0; i < infos_used; i++) index[infos[i].start] = 0, entry[infos[i].start] = nullptr;
+    for (auto& b : opcodes) b = 0;
+    infos_used = 0, code_used = code_base;
+    generation++;
+  }
+  // Swaps the code buffer for one twice the size (or the first one),
+  // dropping every block; compile only calls it with no generated code
+  // running. Returns false if there's no more room to grow or no memory.
+  bool grow(Uxn& u) {
+    size_t size = code_size ? code_size * 2 : MIN_CODE;
+    if (size > CODE_SIZE) return false;
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return false;
+    flush();
+    if (code) munmap(code, code_size);
+    code = static_cast<u8*>(mem), code_size = size;
+    out = code;
+    emit_entry(u);
+    code_base = code_used = out - code;
+    return true;
+  }
+  // Visits the address of every opcode in a block, decoding from `ram`.
+  template <typename F>
+  void each_opcode(const Uxn& u, const Info& b, F f) {
+    u16 a = b.start;
+    for (u8 i = 0; i < b.ops; i++) {
+      f(a);
+      a += op_length(u.ram[a]);
+    }
+  }
+  void mark(const Uxn& u, const Info& b) {
+    each_opcode(u, b, [this](u16 a) { opcodes[a] = 1; });
+  }
+
+  // Native code emission, implemented once per architecture. `emit_entry`
+  // emits whatever code `run` needs once per instance, `emit_op` translates
+  // one instruction given the pc just after its opcode byte and the pc of
+  // the instruction that follows it, and `emit_exit` continues at `next`.
+  // `emit_block_end` is told how many instructions the block has.
+  //
+  // A block is charged all its instructions up front, so an exit after a
+  // write that discarded code gives back the ones it didn't get to run:
+  // `refund_at` holds where each instruction's early exit (if any) takes
+  // the refund, which emit_block_end fills in.
+  u8* out;
+  u8* enter = nullptr;
+  u8* budget_patch[2];
+  u8* refund_at[MAX_BLOCK_OPS];
+  u32 block_ops = 0;
+  void emit8(u8 b) { *out++ = b; }
+  void emit32(u32 v) { for (int i = 0; i < 4; i++) emit8(v >> (i * 8)); }
+  void emit_entry(Uxn& u);
+  void emit_prologue(u16 pc);
+  void emit_op(u8 ins, u16 pc, u16 next);
+  void emit_exit(u16 next);
+  void emit_block_end(u16 pc, u8 ops);
+};
+
+namespace {
+
+#define T *(s->dat + s->ptr)
+#define N *(s->dat + (u8)(s->ptr - 1))
+#define L *(s->dat + (u8)(s->ptr - 2))
+#define X *(s->dat + (u8)(s->ptr - 3))
+#define Y *(s->dat + (u8)(s->ptr - 4))
+#define Z *(s->dat + (u8)(s->ptr - 5))
+#define T2 (N << 8 | T)
+#define H2 (L << 8 | N)
+#define N2 (X << 8 | L)
+#define L2 (Z << 8 | Y)
+#define T2_(v) { r = (v); T = r; N = r >> 8; }
+#define N2_(v) { r = (v); L = r; X = r >> 8; }
+#define L2_(v) { r = (v); Y = r; Z = r >> 8; }
+#define FLIP      { s = ins & 0x40 ? &u->wst : &u->rst; }
+#define SHIFT(y)  { s->ptr += (y); }
+#define SET(x, y) { SHIFT((ins & 0x80) ? x + y : y) }
+
+#define DEI(p)    u->before_dei(p)
+#define DEO(p)    { u8 _d = (p); u->trace_deo(_d); u->after_deo(_d); }
+#define BRK       return BRK_PC
+#define STORED(a) { u16 _a = (a); if (jit.is_code(_a)) jit.invalidate(*u, _a, 1, true); }
+// While hooks are on, compile leaves calls to these, so hooks run on calls
+// only, as in the interpreters.
+#define CALLED    { if (u->hle_at(pc)) u->hle_call(pc); }
+#define JUMPED    u->trace_jump(pc, ins, u->wst.ptr, u->rst.ptr)
+
+// Runs the instruction whose opcode byte is just before `pc`. Control
+// transfers return the next pc (or BRK_PC); everything else returns
+// whether translated code was discarded while it ran.
+template <u8 ins>
+u32 op(Uxn* u, u32 pc_arg) {
+  Stack *s = ins & 0x40 ? &u->rst : &u->wst;
+  Jit& jit = *u->jit;
+  u8 *ram = u->ram, *dev = u->dev, *rr;
+  u16 pc = pc_arg, t, n, l, r;
+  u32 generation = may_write(ins) ? jit.generation : 0;
+  switch(ins & 0x3f) {
+#include "uxn_ops.hpp"
+  }
+  if constexpr (is_control(ins)) return pc;
+  else if constexpr (may_write(ins)) return jit.generation != generation;
+  else return 0;
+}
+
+#define ROW(F, h) \
+  F(h##0) F(h##1) F(h##2) F(h##3) F(h##4) F(h##5) F(h##6) F(h##7) \
+  F(h##8) F(h##9) F(h##a) F(h##b) F(h##c) F(h##d) F(h##e) F(h##f)
+#define OPCODES(F) \
+  ROW(F, 0) ROW(F, 1) ROW(F, 2) ROW(F, 3) ROW(F, 4) ROW(F, 5) ROW(F, 6) ROW(F, 7) \
+  ROW(F, 8) ROW(F, 9) ROW(F, a) ROW(F, b) ROW(F, c) ROW(F, d) ROW(F, e) ROW(F, f)
+#define HANDLER(x) &op<0x##x>,
+
+constexpr Handler handlers[0x100] = { OPCODES(HANDLER) };
+
+}
+
+#if defined(__x86_64__)
+
+// x86-64 backend. `run` enters generated code once, and blocks jump
+// straight to each other through `entry` until they reach a pc that isn't
+// compiled. Meanwhile rbx holds the Uxn*, rbp the base of `ram`, r12/r13
+// the data of the working and return stacks and r14/r15 their pointers (as
+// zero-extended bytes); the pointers are written back around handler calls
+// and on leaving. Common non-keep opcodes are emitted inline, everything
+// else calls its handler.
+
+namespace {
+
+enum : u8 {
+  EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESP = 4, EBP = 5, ESI = 6, EDI = 7,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15, NONE = 0xff
+};
+enum : u8 { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39, TEST = 0x85 };
+enum : u8 { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+constexpr s32 STACK_PTR = 0x101; // offsetof(Stack, ptr)
+
+// Called by generated code that stored to ram[a] and ram[b] when either
+// may be translated code; returns whether any was discarded.
+u32 stored(Uxn* u, u32 a, u32 b) {
+  Jit& jit = *u->jit;
+  u32 generation = jit.generation;
+  STORED(a) STORED(b)
+  return jit.generation != generation;
+}
+
+struct Asm {
+  u8*& out;
+
+  void b(u8 v) { *out++ = v; }
+  void d(u32 v) { for (int i = 0; i < 4; i++) b(v >> (i * 8)); }
+  void rex(bool w, u8 r, u8 index, u8 base, bool force = false) {
+    u8 v = 0x40 | w << 3 | (r >> 3 & 1) << 2 | (index != NONE && index >> 3) << 1 | (base >> 3 & 1);
+    if (v != 0x40 || force) b(v);
+  }
+  void rr(u8 r, u8 rm) { b(0xc0 | (r & 7) << 3 | (rm & 7)); }
+  void mem(u8 r, u8 base, s32 disp, u8 index = NONE) {
+    u8 mod = !disp && (base & 7) != EBP ? 0 : disp >= -128 && disp < 128 ? 1 : 2;
+    if (index == NONE && (base & 7) != ESP) {
+      b(mod << 6 | (r & 7) << 3 | (base & 7));
+    } else {
+      b(mod << 6 | (r & 7) << 3 | 4);
+      b((index == NONE ? 4 : index & 7) << 3 | (base & 7));
+    }
+    if (mod == 1) b(disp);
+    else if (mod == 2) d(disp);
+  }
+
+  void push(u8 r) { rex(0, 0, NONE, r); b(0x50 | (r & 7)); }
+  void pop(u8 r) { rex(0, 0, NONE, r); b(0x58 | (r & 7)); }
+  void mov64(u8 dst, u8 src) { rex(1, src, NONE, dst); b(0x89); rr(src, dst); }
+  void movabs(u8 r, const void* p) {
+    u64 v = reinterpret_cast<u64>(p);
+    rex(1, 0, NONE, r); b(0xb8 | (r & 7)); d(v); d(v >> 32);
+  }
+  void mov_imm(u8 r, u32 v) { rex(0, 0, NONE, r); b(0xb8 | (r & 7)); d(v); }
+  // movzx r32, byte [base + index + disp]
+  void load8(u8 r, u8 base, s32 disp, u8 index = NONE) {
+    rex(0, r, index, base); b(0x0f); b(0xb6); mem(r, base, disp, index);
+  }
+  // mov byte [base + index + disp], r8
+  void store8(u8 r, u8 base, s32 disp, u8 index = NONE) {
+    rex(0, r, index, base, r >= ESP); b(0x88); mem(r, base, disp, index);
+  }
+  void lea(u8 r, u8 base, s32 disp) { rex(0, r, NONE, base); b(0x8d); mem(r, base, disp); }
+  void alu(u8 op, u8 dst, u8 src) { rex(0, src, NONE, dst); b(op); rr(src, dst); }
+  void imul(u8 dst, u8 src) { rex(0, dst, NONE, src); b(0x0f); b(0xaf); rr(dst, src); }
+  void add_imm(u8 r, s32 v) { rex(0, 0, NONE, r); b(0x81); rr(0, r); d(v); }
+  void add8_imm(u8 r, s8 v) { rex(0, 0, NONE, r, r >= ESP); b(0x80); rr(0, r); b(v); }
+  void shl(u8 r, u8 n) { rex(0, 0, NONE, r); b(0xc1); rr(4, r); b(n); }
+  void shr(u8 r, u8 n) { rex(0, 0, NONE, r); b(0xc1); rr(5, r); b(n); }
+  void movzx8(u8 r) { rex(0, r, NONE, r, r >= ESP); b(0x0f); b(0xb6); rr(r, r); }
+  void movzx16(u8 r) { rex(0, r, NONE, r); b(0x0f); b(0xb7); rr(r, r); }
+  void movsx8(u8 r) { rex(0, r, NONE, r, r >= ESP); b(0x0f); b(0xbe); rr(r, r); }
+  void setcc(u8 cc, u8 r) { rex(0, 0, NONE, r, r >= ESP); b(0x0f); b(0x90 | cc); rr(0, r); }
+  void cmovz(u8 dst, u8 src) { rex(0, dst, NONE, src); b(0x0f); b(0x44); rr(dst, src); }
+  void call(u8 r) { rex(0, 0, NONE, r); b(0xff); rr(2, r); }
+  void jmp(u8 r) { rex(0, 0, NONE, r); b(0xff); rr(4, r); }
+  void je(const u8* target) { b(0x0f); b(0x84); d(target - (out + 4)); }
+  void ret() { b(0xc3); }
+  u8* jz8() { b(0x74); b(0); return out; }
+  void patch8(u8* after_jump) { after_jump[-1] = out - after_jump; }
+};
+
+// The registers holding one stack's data and pointer.
+struct StackRegs {
+  u8 dat, ptr;
+};
+constexpr StackRegs WST = { R12, R14 }, RST = { R13, R15 };
+
+struct Emitter : Asm {
+  u8* leave;          // restores the caller's registers and returns eax
+  u8* const* entry;
+  const u8* opcodes;
+  u32* left = nullptr;
+  u8** refund = nullptr; // where this instruction's early exit takes its refund
+  // Byte k places below the top of stack s (k <= 0). esi is scratch.
+  void ld(u8 r, StackRegs s, s8 k) {
+    if (!k) return load8(r, s.dat, 0, s.ptr);
+    lea(ESI, s.ptr, k); movzx8(ESI); load8(r, s.dat, 0, ESI);
+  }
+  void st(u8 r, StackRegs s, s8 k) {
+    if (!k) return store8(r, s.dat, 0, s.ptr);
+    lea(ESI, s.ptr, k); movzx8(ESI); store8(r, s.dat, 0, ESI);
+  }
+  // Shorts, high byte first. edx is scratch.
+  void ld2(u8 r, StackRegs s, s8 k) { ld(r, s, k - 1); shl(r, 8); ld(EDX, s, k); alu(OR, r, EDX); }
+  void st2(u8 r, StackRegs s, s8 k) { st(r, s, k); shr(r, 8); st(r, s, k - 1); }
+  void shift(StackRegs s, s8 n) { if (n) add8_imm(s.ptr, n); }
+  void push_pc(StackRegs s, u16 pc) { shift(s, 2); mov_imm(ECX, pc); st2(ECX, s, 0); }
+  // eax = pc + 2 + peek2(ram + pc)
+  void immediate_target(u16 pc) {
+    load8(EAX, EBP, pc); shl(EAX, 8); load8(EDX, EBP, pc + 1); alu(OR, EAX, EDX);
+    add_imm(EAX, pc + 2); movzx16(EAX);
+  }
+  // eax = pc + (s8)al
+  void relative_target(u16 pc) { movsx8(EAX); add_imm(EAX, pc); movzx16(EAX); }
+  // eax = ecx ? eax : pc
+  void unless_zero(u16 pc) { mov_imm(EDX, pc); alu(TEST, ECX, ECX); cmovz(EAX, EDX); }
+
+  void sync() { store8(R14, R12, STACK_PTR); store8(R15, R13, STACK_PTR); }
+  void reload() { load8(R14, R12, STACK_PTR); load8(R15, R13, STACK_PTR); }
+  // Continues at the pc in eax.
+  void dispatch() {
+    b(0x3d), d(BRK_PC);                 // cmp eax, BRK_PC
+    je(leave);
+    movabs(EDX, entry);
+    b(0x48), b(0x8b), b(0x14), b(0xc2); // mov rdx, [rdx + rax * 8]
+    b(0x48), alu(TEST, EDX, EDX);
+    je(leave);
+    jmp(EDX);
+  }
+  void prologue(Uxn& u) {
+    constexpr u8 saved[] = { EBX, EBP, R12, R13, R14, R15 };
+    for (u8 r : saved) push(r);
+    b(0x48), b(0x83), b(0xec), b(0x08); // sub rsp, 8
+    mov64(EBX, EDI);
+    movabs(EBP, u.ram);
+    movabs(R12, u.wst.dat);
+    movabs(R13, u.rst.dat);
+    reload();
+  }
+  void epilogue() {
+    sync();
+    b(0x48), b(0x83), b(0xc4), b(0x08); // add rsp, 8
+    constexpr u8 saved[] = { R15, R14, R13, R12, EBP, EBX };
+    for (u8 r : saved) pop(r);
+    ret();
+  }
+  void exit(u16 pc) { mov_imm(EAX, pc); dispatch(); }
+  // Leaves at `pc` after a write discarded code, giving back to `left`
+  // the rest of the block (filled in at *refund).
+  void early_exit(u16 pc) {
+    movabs(EDX, left);
+    b(0x81), b(0x02), *refund = out, d(0); // add dword [rdx], unrun
+    exit(pc);
+  }
+  void call_handler(u8 ins, u16 pc) {
+    sync();
+    mov64(EDI, EBX);
+    mov_imm(ESI, pc);
+    movabs(EAX, reinterpret_cast<const void*>(handlers[ins]));
+    call(EAX);
+    reload();
+  }
+
+  // After storing to ram[a] and ram[b] (b may equal a): leaves at `next`
+  // if that discarded any translated code.
+  void check_store(u8 a, u8 b, u16 next) {
+    movabs(ESI, opcodes);
+    load8(ECX, ESI, 0, a);
+    if (b != a) load8(EDI, ESI, 0, b), alu(OR, ECX, EDI);
+    alu(TEST, ECX, ECX);
+    u8* clean = jz8();
+    sync();
+    if (b == a) alu(0x89, EDX, a);
+    alu(0x89, ESI, a);
+    mov64(EDI, EBX);
+    movabs(EAX, reinterpret_cast<const void*>(&stored));
+    call(EAX);
+    reload();
+    alu(TEST, EAX, EAX);
+    u8* kept = jz8();
+    early_exit(next);
+    patch8(kept);
+    patch8(clean);
+  }
+  // ram[eax] = ch, ram[edx] = cl
+  void store2(u16 next) {
+    store8(ECX, EBP, 0, EDX); shr(ECX, 8); store8(ECX, EBP, 0, EAX);
+    check_store(EAX, EDX, next);
+  }
+
+  void binary(u8 ins, StackRegs s) {
+    bool wide = ins & 0x20;
+    if (wide) ld2(ECX, s, 0), ld2(EAX, s, -2);
+    else ld(ECX, s, 0), ld(EAX, s, -1);
+    switch (ins & 0x1f) {
+      case 0x08: case 0x09: case 0x0a: case 0x0b: {
+        constexpr u8 cc[] = { CC_E, CC_NE, CC_A, CC_B };
+        alu(CMP, EAX, ECX); setcc(cc[(ins & 0x1f) - 0x08], EAX); movzx8(EAX);
+        shift(s, wide ? -3 : -1);
+        st(EAX, s, 0);
+        return;
+      }
+      case 0x18: alu(ADD, EAX, ECX); break;
+      case 0x19: alu(SUB, EAX, ECX); break;
+      case 0x1a: imul(EAX, ECX); break;
+      case 0x1c: alu(AND, EAX, ECX); break;
+      case 0x1d: alu(OR, EAX, ECX); break;
+      case 0x1e: alu(XOR, EAX, ECX); break;
+    }
+    if (wide) shift(s, -2), st2(EAX, s, 0);
+    else shift(s, -1), st(EAX, s, 0);
+  }
+
+  // Emits `ins` without a handler call if it can; control transfers leave
+  // the block with the target in eax.
+  bool inline_op(u8 ins, u16 pc, u16 next) {
+    StackRegs s = ins & 0x40 ? RST : WST, o = ins & 0x40 ? WST : RST;
+    switch (ins) {
+      case 0x00: /* BRK  */ mov_imm(EAX, BRK_PC); dispatch(); return true;
+      case 0x20: /* JCI  */ ld(ECX, WST, 0); shift(WST, -1); immediate_target(pc);
+                            unless_zero(static_cast<u16>(pc + 2)); dispatch(); return true;
+      case 0x40: /* JMI  */ immediate_target(pc); dispatch(); return true;
+      case 0x60: /* JSI  */ push_pc(RST, static_cast<u16>(pc + 2)); immediate_target(pc); dispatch(); return true;
+      case 0x80: /* LIT  */ case 0xc0: shift(s, 1); load8(EAX, EBP, pc); st(EAX, s, 0); return true;
+      case 0xa0: /* LIT2 */ case 0xe0: shift(s, 2); load8(EAX, EBP, pc); st(EAX, s, -1);
+                            load8(EAX, EBP, pc + 1); st(EAX, s, 0); return true;
+    }
+    if (ins & 0x80) return false;
+    switch (ins & 0x3f) {
+      case 0x01: /* INC  */ ld(EAX, s, 0); add_imm(EAX, 1); st(EAX, s, 0); return true;
+      case 0x21: /* INC2 */ ld2(EAX, s, 0); add_imm(EAX, 1); st2(EAX, s, 0); return true;
+      case 0x02: /* POP  */ shift(s, -1); return true;
+      case 0x22: /* POP2 */ shift(s, -2); return true;
+      case 0x03: /* NIP  */ ld(EAX, s, 0); shift(s, -1); st(EAX, s, 0); return true;
+      case 0x23: /* NIP2 */ ld2(EAX, s, 0); shift(s, -2); st2(EAX, s, 0); return true;
+      case 0x04: /* SWP  */ ld(EAX, s, 0); ld(ECX, s, -1); st(ECX, s, 0); st(EAX, s, -1); return true;
+      case 0x06: /* DUP  */ ld(EAX, s, 0); shift(s, 1); st(EAX, s, 0); return true;
+      case 0x26: /* DUP2 */ ld(EAX, s, -1); ld(ECX, s, 0); shift(s, 2); st(ECX, s, 0); st(EAX, s, -1); return true;
+      case 0x07: /* OVR  */ ld(EAX, s, 0); ld(ECX, s, -1); shift(s, 1);
+                            st(ECX, s, 0); st(EAX, s, -1); st(ECX, s, -2); return true;
+      case 0x08: case 0x09: case 0x0a: case 0x0b:
+      case 0x28: case 0x29: case 0x2a: case 0x2b:
+      case 0x18: case 0x19: case 0x1a: case 0x1c: case 0x1d: case 0x1e:
+      case 0x38: case 0x39: case 0x3a: case 0x3c: case 0x3d: case 0x3e:
+        binary(ins, s); return true;
+      case 0x0c: /* JMP  */ ld(EAX, s, 0); shift(s, -1); relative_target(next); dispatch(); return true;
+      case 0x2c: /* JMP2 */ ld2(EAX, s, 0); shift(s, -2); dispatch(); return true;
+      case 0x0d: /* JCN  */ ld(EAX, s, 0); ld(ECX, s, -1); shift(s, -2); relative_target(next);
+                            unless_zero(next); dispatch(); return true;
+      case 0x2d: /* JCN2 */ ld2(EAX, s, 0); ld(ECX, s, -2); shift(s, -3); unless_zero(next); dispatch(); return true;
+      case 0x0e: /* JSR  */ ld(EAX, s, 0); shift(s, -1); relative_target(next); push_pc(o, next); dispatch(); return true;
+      case 0x2e: /* JSR2 */ ld2(EAX, s, 0); shift(s, -2); push_pc(o, next); dispatch(); return true;
+      case 0x0f: /* STH  */ ld(EAX, s, 0); shift(s, -1); shift(o, 1); st(EAX, o, 0); return true;
+      case 0x2f: /* STH2 */ ld2(EAX, s, 0); shift(s, -2); shift(o, 2); st2(EAX, o, 0); return true;
+      case 0x10: /* LDZ  */ ld(EAX, s, 0); load8(EAX, EBP, 0, EAX); st(EAX, s, 0); return true;
+      case 0x30: /* LDZ2 */ ld(EAX, s, 0); shift(s, 1); load8(ECX, EBP, 0, EAX); add_imm(EAX, 1); movzx8(EAX);
+                            load8(EAX, EBP, 0, EAX); st(ECX, s, -1); st(EAX, s, 0); return true;
+      case 0x12: /* LDR  */ ld(EAX, s, 0); relative_target(next); load8(EAX, EBP, 0, EAX); st(EAX, s, 0); return true;
+      case 0x32: /* LDR2 */ ld(EAX, s, 0); shift(s, 1); relative_target(next); load8(ECX, EBP, 0, EAX);
+                            add_imm(EAX, 1); movzx16(EAX); load8(EAX, EBP, 0, EAX);
+                            st(ECX, s, -1); st(EAX, s, 0); return true;
+      case 0x14: /* LDA  */ ld2(EAX, s, 0); load8(EAX, EBP, 0, EAX); shift(s, -1); st(EAX, s, 0); return true;
+      case 0x11: /* STZ  */ ld(EAX, s, 0); ld(ECX, s, -1); shift(s, -2);
+                            store8(ECX, EBP, 0, EAX); check_store(EAX, EAX, next); return true;
+      case 0x31: /* STZ2 */ ld(EAX, s, 0); ld2(ECX, s, -1); shift(s, -3);
+                            lea(EDX, EAX, 1); movzx8(EDX); store2(next); return true;
+      case 0x13: /* STR  */ ld(EAX, s, 0); ld(ECX, s, -1); shift(s, -2); relative_target(next);
+                            store8(ECX, EBP, 0, EAX); check_store(EAX, EAX, next); return true;
+      case 0x33: /* STR2 */ ld(EAX, s, 0); ld2(ECX, s, -1); shift(s, -3); relative_target(next);
+                            lea(EDX, EAX, 1); movzx16(EDX); store2(next); return true;
+      case 0x15: /* STA  */ ld2(EAX, s, 0); ld(ECX, s, -2); shift(s, -3);
+                            store8(ECX, EBP, 0, EAX); check_store(EAX, EAX, next); return true;
+      case 0x35: /* STA2 */ ld2(EAX, s, 0); ld2(ECX, s, -2); shift(s, -4);
+                            lea(EDX, EAX, 1); movzx16(EDX); store2(next); return true;
+      case 0x34: /* LDA2 */ ld2(EAX, s, 0); load8(ECX, EBP, 0, EAX); add_imm(EAX, 1); movzx16(EAX);
+                            load8(EAX, EBP, 0, EAX); st(ECX, s, -1); st(EAX, s, 0); return true;
+    }
+    return false;
+  }
+};
+
+}
+
+// Emits the code that leaves generated code at `code`, then `enter`.
+void Jit::emit_entry(Uxn& u) {
+  Emitter e{{out}, code, entry, opcodes};
+  e.epilogue();
+  enter = out;
+  e.prologue(u);
+  e.b(0x89), e.b(0xf0); // mov eax, esi
+  e.dispatch();
+}
+
+// Blocks start by taking their instruction count from `left`, or leave
+// through a stub at the end if it doesn't fit.
+void Jit::emit_prologue(u16) {
+  Emitter e{{out}, code, entry, opcodes};
+  block_ops = 0;
+  e.movabs(EDX, &left);
+  e.b(0x81), e.b(0x3a), budget_patch[0] = out, e.d(0); // cmp dword [rdx], ops
+  e.b(0x0f), e.b(0x82), budget_patch[1] = out, e.d(0); // jb stub
+  e.b(0x81), e.b(0x2a), e.d(0);                        // sub dword [rdx], ops
+}
+
+void Jit::emit_block_end(u16 pc, u8 ops) {
+  Emitter e{{out}, code, entry, opcodes};
+  for (int i = 0; i < 4; i++) budget_patch[0][i] = budget_patch[0][i + 12] = ops >> (i * 8);
+  u32 rel = out - (budget_patch[1] + 4);
+  for (int i = 0; i < 4; i++) budget_patch[1][i] = rel >> (i * 8);
+  for (u32 op = 0; op < ops; op++)
+    if (u8* at = refund_at[op]) for (int i = 0; i < 4; i++) at[i] = (ops - op - 1) >> (i * 8);
+  e.mov_imm(EAX, pc);
+  e.b(0xe9), e.d(code - (out + 4));                    // jmp leave
+}
+
+u32 Jit::run(Uxn& u, u32 pc) {
+  if (!code) return pc;
+  return reinterpret_cast<u32 (*)(Uxn*, u32)>(enter)(&u, pc);
+}
+
+void Jit::emit_op(u8 ins, u16 pc, u16 next) {
+  Emitter e{{out}, code, entry, opcodes, &left, &refund_at[block_ops]};
+  refund_at[block_ops++] = nullptr;
+  if (!(hooks && is_call(ins)) && e.inline_op(ins, pc, next)) return;
+  e.call_handler(ins, pc);
+  if (is_control(ins)) {
+    e.dispatch();
+  } else if (may_write(ins)) {
+    e.alu(TEST, EAX, EAX);
+    u8* skip = e.jz8();
+    e.early_exit(next);
+    e.patch8(skip);
+  }
+}
+
+void Jit::emit_exit(u16 next) {
+  Emitter{{out}, code, entry, opcodes}.exit(next);
+}
+
+#else
+
+// AArch64 backend: call-threaded. Each block is a function of the Uxn*
+// returning the next pc; x19 holds the Uxn* and every instruction goes
+// through its handler.
+
+namespace {
+
+constexpr u32 PUSH_X19_LR = 0xa9bf7bf3; // stp x19, x30, [sp, #-16]!
+constexpr u32 POP_X19_LR  = 0xa8c17bf3; // ldp x19, x30, [sp], #16
+constexpr u32 MOV_X19_X0  = 0xaa0003f3; // mov x19, x0
+constexpr u32 MOV_X0_X19  = 0xaa1303e0; // mov x0, x19
+constexpr u32 BLR_X16     = 0xd63f0200; // blr x16
+constexpr u32 CBZ_W0_5    = 0x340000a0; // cbz w0, .+20
+constexpr u32 RET         = 0xd65f03c0;
+
+constexpr u32 movz_w(u8 r, u16 imm) { return 0x52800000 | imm << 5 | r; }
+constexpr u32 movk_w16(u8 r, u16 imm) { return 0x72a00000 | imm << 5 | r; }
+
+// Blocks return the next pc, plus (above it) what an early exit gives
+// back to `left`.
+constexpr u32 REFUND_SHIFT = 17;
+
+}
+
+void Jit::emit_entry(Uxn&) {}
+
+u32 Jit::run(Uxn& u, u32 pc) {
+  while (pc != BRK_PC && entry[pc] && infos[index[pc] - 1].ops <= left) {
+    left -= infos[index[pc] - 1].ops;
+    u32 r = reinterpret_cast<u32 (*)(Uxn*)>(entry[pc])(&u);
+    left += r >> REFUND_SHIFT;
+    pc = r & ((1 << REFUND_SHIFT) - 1);
+  }
+  return pc;
+}
+
+void Jit::emit_prologue(u16) {
+  block_ops = 0;
+  emit32(PUSH_X19_LR);
+  emit32(MOV_X19_X0);
+}
+
+void Jit::emit_block_end(u16, u8 ops) {
+  for (u32 op = 0; op < ops; op++) {
+    u8* at = refund_at[op];
+    if (!at) continue;
+    u32 v = movk_w16(0, (ops - op - 1) << (REFUND_SHIFT - 16));
+    for (int i = 0; i < 4; i++) at[i] = v >> (i * 8);
+  }
+}
+
+void Jit::emit_op(u8 ins, u16 pc, u16 next) {
+  u64 h = reinterpret_cast<u64>(handlers[ins]);
+  emit32(MOV_X0_X19);
+  emit32(movz_w(1, pc));
+  emit32(0xd2800010 | (h & 0xffff) << 5);       // movz x16, #h
+  emit32(0xf2a00010 | (h >> 16 & 0xffff) << 5); // movk x16, #h, lsl 16
+  emit32(0xf2c00010 | (h >> 32 & 0xffff) << 5); // movk x16, #h, lsl 32
+  emit32(0xf2e00010 | (h >> 48 & 0xffff) << 5); // movk x16, #h, lsl 48
+  emit32(BLR_X16);
+  refund_at[block_ops++] = nullptr;
+  if (is_control(ins)) {
+    emit32(POP_X19_LR);
+    emit32(RET);
+  } else if (may_write(ins)) {
+    emit32(CBZ_W0_5);
+    emit32(movz_w(0, next));
+    refund_at[block_ops - 1] = out;
+    emit32(movk_w16(0, 0));
+    emit32(POP_X19_LR);
+    emit32(RET);
+  }
+}
+
+void Jit::emit_exit(u16 next) {
+  emit32(movz_w(0, next));
+  emit32(POP_X19_LR);
+  emit32(RET);
+}
+
+#endif
+
+bool Jit::compile(Uxn& u, u16 pc) {
+  if (infos_used == MAX_BLOCKS) flush();
+  if (code_used + MAX_BLOCK_CODE > code_size && !grow(u)) {
+    if (!code) return ok = false;
+    flush();
+  }
+  u8* begin = out = code + code_used;
+  u32 a = pc, ops = 0;
+  hooks = u.hle != Hle::Off;
+  emit_prologue(pc);
+  for (;;) {
+    u8 ins = u.ram[a];
+    u32 next = a + op_length(ins);
+    // Leave instructions that wrap around the end of memory to the interpreter.
+    if (next > 0x10000) {
+      if (!ops) return false;
+      emit_exit(a);
+      break;
+    }
+    emit_op(ins, (a + 1) & 0xffff, next & 0xffff);
+    ops++;
+    if (is_control(ins)) break;
+    a = next;
+    if (ops == MAX_BLOCK_OPS || a == 0x10000) {
+      emit_exit(a & 0xffff);
+      break;
+    }
+  }
+  emit_block_end(pc, ops);
+  __builtin___clear_cache(reinterpret_cast<char*>(begin), reinterpret_cast<char*>(out));
+  code_used = out - code;
+
+  Info& b = infos[infos_used++];
+  b.start = pc;
+  b.ops = ops;
+  index[pc] = infos_used;
+  entry[pc] = begin;
+  mark(u, b);
+  if (perf_map) {
+    fprintf(perf_map, "%lx %lx uxn_%04x\n", reinterpret_cast<unsigned long>(begin), static_cast<unsigned long>(out - begin), pc);
+    fflush(perf_map);
+  }
+  return true;
+}
+
+// Runs up to one block's worth of instructions (within `left`) through
+// the handlers, without translating anything.
+u32 Jit::interpret(Uxn& u, u16 pc) {
+  for (u32 ops = 0; ops < MAX_BLOCK_OPS && left; ops++, left--) {
+    u8 ins = u.ram[pc];
+    u32 next = handlers[ins](&u, static_cast<u16>(pc + 1));
+    if (is_control(ins)) return left--, next;
+    pc += op_length(ins);
+  }
+  return pc;
+}
+
+void Jit::invalidate(Uxn& u, u16 addr, u32 length, bool opcodes_only) {
+  u32 lo = addr > MAX_BLOCK_BYTES ? addr - MAX_BLOCK_BYTES : 0, hi = addr + length;
+  bool dropped = false;
+  for (u32 start = lo; start < hi && start < 0x10000; start++) {
+    u16 i = index[start];
+    if (!i) continue;
+    Info& b = infos[i - 1];
+    bool hit = false;
+    each_opcode(u, b, [&](u16 a) {
+      if (a >= addr && a < hi && (!opcodes_only || a == addr)) hit = true;
+    });
+    if (!hit) continue;
+    index[start] = 0, entry[start] = nullptr;
+    if (hot[start >> 8] < HOT_PAGE) hot[start >> 8]++;
+    dropped = true;
+  }
+  if (!dropped) return;
+  generation++;
+  // Rebuild the opcode map around the change from the surviving blocks.
+  u32 clear_lo = lo, clear_hi = hi + MAX_BLOCK_BYTES > 0x10000 ? 0x10000 : hi + MAX_BLOCK_BYTES;
+  for (u32 a = clear_lo; a < clear_hi; a++) opcodes[a] = 0;
+  u32 scan_lo = clear_lo > MAX_BLOCK_BYTES ? clear_lo - MAX_BLOCK_BYTES : 0;
+  for (u32 start = scan_lo; start < clear_hi; start++)
+    if (u16 i = index[start]) mark(u, infos[i - 1]);
+}
+
+bool Uxn::eval_jit(u16 pc, Budget* budget) {
+  if (!initialized || !pc || dev[0x0f]) return 0;
+  if (!jit) jit = new Jit();
+  if (!jit->ok) return eval_threaded(pc, budget);
+  // Code is only compiled (and so only flushed) by the outermost call,
+  // when no generated code is on the stack.
+  jit->depth++;
+  u32 outer_left = jit->left;
+  jit->left = budget ? budget->left : ~0u;
+  u32 next = pc;
+  while ((next = jit->run(*this, next)) != BRK_PC) {
+    if (!jit->left) {
+      if (budget) {
+        budget->pc = next, budget->stopped = true;
+        break;
+      }
+      jit->left = ~0u;
+    } else if (!jit->is_compiled(next) && jit->depth == 1 && !jit->is_hot(next) && jit->compile(*this, next)) {
+      continue;
+    }
+    next = jit->interpret(*this, next);
+    if (next == BRK_PC) break;
+  }
+  if (budget) budget->left = jit->left;
+  jit->left = outer_left;
+  jit->depth--;
+  return 1;
+}
+
+void Uxn::jit_invalidate(u16 addr, u32 length) {
+  for (u32 done = 0; done < length;) {
+    u32 chunk = length - done < 0x10000u - addr ? length - done : 0x10000u - addr;
+    jit->invalidate(*this, addr, chunk, false);
+    done += chunk, addr = static_cast<u16>(addr + chunk);
+  }
+}
+
+void Uxn::jit_release() {
+  if (jit) delete jit;
+  jit = nullptr;
+}
+
+#else
+
+bool Uxn::eval_jit(u16 pc, Budget* budget) {
+  return eval_threaded(pc, budget);
+}
+
+void Uxn::jit_invalidate(u16 addr, u32 length) {}
+
+void Uxn::jit_release() {}
+
+#endif
+
+}
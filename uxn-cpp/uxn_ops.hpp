@@ -0,0 +1,92 @@
+// Opcode bodies shared by every Uxn evaluation engine.
+//
+// This file has no include guard on purpose: it is included inside a
+// `switch(ins & 0x3f)`, and the including engine defines how the stack,
+// program counter and devices are reached. Required macros:
+//
+//   T N L X Y Z T2 H2 N2 L2 T2_ N2_ L2_   stack registers (see uxn.cpp)
+//   FLIP SHIFT(y) SET(x, y)               stack pointer movement
+//   DEI(p) DEO(p)                         device hooks
+//   BRK                                   leave the engine at a BRK
+//   STORED(a)                             after the CPU writes ram[a]
+//   CALLED                                after a call has set `pc` to its
+//                                         target and pushed the return
+//                                         address to the return stack
+//   JUMPED                                after any control instruction,
+//                                         taken or not, has set `pc`
+//
+// and the locals `ins`, `pc`, `ram`, `dev`, `t`, `n`, `l`, `r`, `rr`.
+
+/* IMM */
+case 0x00: case 0x20:
+  switch(ins) {
+  case 0x00: /* BRK  */                       BRK;
+  case 0x20: /* JCI  */ t=T;        SHIFT(-1) if(!t) { pc += 2; JUMPED; break; } /* fall-through */
+  case 0x40: /* JMI  */                       rr = ram + pc; pc += 2 + peek2(rr); JUMPED; break;
+  case 0x60: /* JSI  */             SHIFT( 2) rr = ram + pc; pc += 2; T2_(pc); pc += peek2(rr); CALLED; JUMPED; break;
+  case 0x80: /* LIT  */ case 0xc0:  SHIFT( 1) T = ram[pc++]; break;
+  case 0xa0: /* LIT2 */ case 0xe0:  SHIFT( 2) N = ram[pc++]; T = ram[pc++]; break;
+  } break;
+/* ALU */
+case 0x01: /* INC  */ t=T;            SET(1, 0) T = t + 1; break;
+case 0x21: /* INC2 */ t=T2;           SET(2, 0) T2_(t + 1) break;
+case 0x02: /* POP  */                 SET(1,-1) break;
+case 0x22: /* POP2 */                 SET(2,-2) break;
+case 0x03: /* NIP  */ t=T;            SET(2,-1) T = t; break;
+case 0x23: /* NIP2 */ t=T2;           SET(4,-2) T2_(t) break;
+case 0x04: /* SWP  */ t=T;n=N;        SET(2, 0) T = n; N = t; break;
+case 0x24: /* SWP2 */ t=T2;n=N2;      SET(4, 0) T2_(n) N2_(t) break;
+case 0x05: /* ROT  */ t=T;n=N;l=L;    SET(3, 0) T = l; N = t; L = n; break;
+case 0x25: /* ROT2 */ t=T2;n=N2;l=L2; SET(6, 0) T2_(l) N2_(t) L2_(n) break;
+case 0x06: /* DUP  */ t=T;            SET(1, 1) T = t; N = t; break;
+case 0x26: /* DUP2 */ t=T2;           SET(2, 2) T2_(t) N2_(t) break;
+case 0x07: /* OVR  */ t=T;n=N;        SET(2, 1) T = n; N = t; L = n; break;
+case 0x27: /* OVR2 */ t=T2;n=N2;      SET(4, 2) T2_(n) N2_(t) L2_(n) break;
+case 0x08: /* EQU  */ t=T;n=N;        SET(2,-1) T = n == t; break;
+case 0x28: /* EQU2 */ t=T2;n=N2;      SET(4,-3) T = n == t; break;
+case 0x09: /* NEQ  */ t=T;n=N;        SET(2,-1) T = n != t; break;
+case 0x29: /* NEQ2 */ t=T2;n=N2;      SET(4,-3) T = n != t; break;
+case 0x0a: /* GTH  */ t=T;n=N;        SET(2,-1) T = n > t; break;
+case 0x2a: /* GTH2 */ t=T2;n=N2;      SET(4,-3) T = n > t; break;
+case 0x0b: /* LTH  */ t=T;n=N;        SET(2,-1) T = n < t; break;
+case 0x2b: /* LTH2 */ t=T2;n=N2;      SET(4,-3) T = n < t; break;
+case 0x0c: /* JMP  */ t=T;            SET(1,-1) pc += (s8)t; JUMPED; break;
+case 0x2c: /* JMP2 */ t=T2;           SET(2,-2) pc = t; JUMPED; break;
+case 0x0d: /* JCN  */ t=T;n=N;        SET(2,-2) if(n) pc += (s8)t; JUMPED; break;
+case 0x2d: /* JCN2 */ t=T2;n=L;       SET(3,-3) if(n) pc = t; JUMPED; break;
+case 0x0e: /* JSR  */ t=T;            SET(1,-1) FLIP SHIFT(2) T2_(pc) pc += (s8)t; if (!(ins & 0x40)) CALLED; JUMPED; break;
+case 0x2e: /* JSR2 */ t=T2;           SET(2,-2) FLIP SHIFT(2) T2_(pc) pc = t; if (!(ins & 0x40)) CALLED; JUMPED; break;
+case 0x0f: /* STH  */ t=T;            SET(1,-1) FLIP SHIFT(1) T = t; break;
+case 0x2f: /* STH2 */ t=T2;           SET(2,-2) FLIP SHIFT(2) T2_(t) break;
+case 0x10: /* LDZ  */ t=T;            SET(1, 0) T = ram[t]; break;
+case 0x30: /* LDZ2 */ t=T;            SET(1, 1) N = ram[t++]; T = ram[(u8)t]; break;
+case 0x11: /* STZ  */ t=T;n=N;        SET(2,-2) ram[t] = n; STORED(t); break;
+case 0x31: /* STZ2 */ t=T;n=H2;       SET(3,-3) ram[t++] = n >> 8; ram[(u8)t] = n; STORED((u8)(t - 1)); STORED((u8)t); break;
+case 0x12: /* LDR  */ t=T;            SET(1, 0) r = pc + (s8)t; T = ram[r]; break;
+case 0x32: /* LDR2 */ t=T;            SET(1, 1) r = pc + (s8)t; N = ram[r++]; T = ram[r]; break;
+case 0x13: /* STR  */ t=T;n=N;        SET(2,-2) r = pc + (s8)t; ram[r] = n; STORED(r); break;
+case 0x33: /* STR2 */ t=T;n=H2;       SET(3,-3) r = pc + (s8)t; ram[r++] = n >> 8; ram[r] = n; STORED((u16)(r - 1)); STORED(r); break;
+case 0x14: /* LDA  */ t=T2;           SET(2,-1) T = ram[t]; break;
+case 0x34: /* LDA2 */ t=T2;           SET(2, 0) N = ram[t++]; T = ram[t]; break;
+case 0x15: /* STA  */ t=T2;n=L;       SET(3,-3) ram[t] = n; STORED(t); break;
+case 0x35: /* STA2 */ t=T2;n=N2;      SET(4,-4) ram[t++] = n >> 8; ram[t] = n; STORED((u16)(t - 1)); STORED(t); break;
+case 0x16: /* DEI  */ t=T;            SET(1, 0) DEI(t); T = dev[t]; break;
+case 0x36: /* DEI2 */ t=T;            SET(1, 1) DEI(t); DEI(t+1); N = dev[t++]; T = dev[t]; break;
+case 0x17: /* DEO  */ t=T;n=N;        SET(2,-2) dev[t] = n; DEO(t); break;
+case 0x37: /* DEO2 */ t=T;n=N;l=L;    SET(3,-3) dev[t] = l; dev[t+1] = n; DEO(t++); DEO(t); break;
+case 0x18: /* ADD  */ t=T;n=N;        SET(2,-1) T = n + t; break;
+case 0x38: /* ADD2 */ t=T2;n=N2;      SET(4,-2) T2_(n + t) break;
+case 0x19: /* SUB  */ t=T;n=N;        SET(2,-1) T = n - t; break;
+case 0x39: /* SUB2 */ t=T2;n=N2;      SET(4,-2) T2_(n - t) break;
+case 0x1a: /* MUL  */ t=T;n=N;        SET(2,-1) T = n * t; break;
+case 0x3a: /* MUL2 */ t=T2;n=N2;      SET(4,-2) T2_(n * t) break;
+case 0x1b: /* DIV  */ t=T;n=N;        SET(2,-1) T = t ? n / t : 0; break;
+case 0x3b: /* DIV2 */ t=T2;n=N2;      SET(4,-2) T2_(t ? n / t : 0) break;
+case 0x1c: /* AND  */ t=T;n=N;        SET(2,-1) T = n & t; break;
+case 0x3c: /* AND2 */ t=T2;n=N2;      SET(4,-2) T2_(n & t) break;
+case 0x1d: /* ORA  */ t=T;n=N;        SET(2,-1) T = n | t; break;
+case 0x3d: /* ORA2 */ t=T2;n=N2;      SET(4,-2) T2_(n | t) break;
+case 0x1e: /* EOR  */ t=T;n=N;        SET(2,-1) T = n ^ t; break;
+case 0x3e: /* EOR2 */ t=T2;n=N2;      SET(4,-2) T2_(n ^ t) break;
+case 0x1f: /* SFT  */ t=T;n=N;        SET(2,-1) T = n >> (t & 0xf) << (t >> 4); break;
+case 0x3f: /* SFT2 */ t=T;n=H2;       SET(3,-1) T2_(n >> (t & 0xf) << (t >> 4)) break;
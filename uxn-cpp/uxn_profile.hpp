@@ -0,0 +1,56 @@
+#pragma once
+#include "uxn.hpp"
+#include <stdio.h>
+
+#ifdef UXN_PROFILE
+
+namespace uxn {
+
+// Writes `profile` as JSON: one object per vector, with its totals and
+// counts by opcode name, by pc and by device port ([count, ticks] for
+// ports). Zero counts are left out, and addresses and ports are hex.
+static inline void write_profile_json(FILE* f, const Profile& profile, u64 ticks_per_second) {
+  fprintf(f, "{\n  \"ticks_per_second\": %llu,\n  \"vectors\": [", (unsigned long long)ticks_per_second);
+  for (u8 v = 0; v < profile.used; v++) {
+    const VectorProfile& p = *profile.vectors[v];
+    fprintf(f, "%s\n    {\n      \"vector\": \"%04x\", \"entries\": %llu, \"instructions\": %llu, \"ticks\": %llu,\n",
+            v ? "," : "", p.vector, (unsigned long long)p.entries, (unsigned long long)p.instructions,
+            (unsigned long long)p.ticks);
+    fprintf(f, "      \"opcodes\": {");
+    const char* sep = "";
+    for (u32 i = 0; i < 0x100; i++) {
+      if (!p.opcodes[i]) continue;
+      char name[8];
+      opcode_name(i, name);
+      fprintf(f, "%s\"%s\": %llu", sep, name, (unsigned long long)p.opcodes[i]);
+      sep = ", ";
+    }
+    fprintf(f, "},\n      \"dei\": {");
+    sep = "";
+    for (u32 i = 0; i < 0x100; i++) {
+      if (!p.dei[i]) continue;
+      fprintf(f, "%s\"%02x\": [%llu, %llu]", sep, i, (unsigned long long)p.dei[i], (unsigned long long)p.dei_ticks[i]);
+      sep = ", ";
+    }
+    fprintf(f, "},\n      \"deo\": {");
+    sep = "";
+    for (u32 i = 0; i < 0x100; i++) {
+      if (!p.deo[i]) continue;
+      fprintf(f, "%s\"%02x\": [%llu, %llu]", sep, i, (unsigned long long)p.deo[i], (unsigned long long)p.deo_ticks[i]);
+      sep = ", ";
+    }
+    fprintf(f, "},\n      \"pcs\": {");
+    sep = "";
+    for (u32 i = 0; i < 0x10000; i++) {
+      if (!p.pcs[i]) continue;
+      fprintf(f, "%s\"%04x\": %llu", sep, i, (unsigned long long)p.pcs[i]);
+      sep = ", ";
+    }
+    fprintf(f, "}\n    }");
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+}
+
+#endif
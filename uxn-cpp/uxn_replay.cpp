@@ -0,0 +1,55 @@
+#include "headless_varvara.hpp"
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+/* Plays back a session recorded with uxn_sdl -record (or record= on the
+   Pi), with no window:
+
+     uxn_replay [-switch|-threaded|-decoded|-jit|-aot] rom recording
+
+   The ROM's console output goes to stdout as it did in the session, and a
+   summary to stderr, with checksums of the memory and screen it ended
+   with, and the engine it was recorded on if it went out of sync. The
+   ROM's own directory is its sandbox, as in uxn_bench. */
+
+static const char* const ENGINES[] = { "switch", "threaded", "decoded", "jit", "aot" };
+
+int main(int argc, char** argv) {
+  using namespace uxn;
+  Engine engine = Engine::Threaded;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-switch")) engine = Engine::Switch;
+    else if (!strcmp(argv[i], "-threaded")) engine = Engine::Threaded;
+    else if (!strcmp(argv[i], "-decoded")) engine = Engine::Decoded;
+    else if (!strcmp(argv[i], "-jit")) engine = Engine::Jit;
+    else if (!strcmp(argv[i], "-aot")) engine = Engine::Aot;
+    else break;
+  }
+  if (argc - i != 2) {
+    fprintf(stderr, "usage: %s [-switch|-threaded|-decoded|-jit|-aot] rom recording\n", argv[0]);
+    return 1;
+  }
+  auto rom = std::filesystem::absolute(argv[i]);
+  std::string dir = rom.parent_path().string(), name = rom.filename().string();
+  HeadlessVarvara v(640, 480, dir.c_str(), name.c_str());
+  v.engine = engine;
+  bool in_sync = v.replay(argv[i + 1]);
+  fflush(stdout);
+  if (!v.initialized) {
+    fprintf(stderr, "%s: could not replay %s with %s\n", argv[0], argv[i + 1], argv[i]);
+    return 1;
+  }
+  u64 screen = hash_bytes(reinterpret_cast<const u8*>(v.framebuffer()), v.width() * v.height() * sizeof(u32));
+  fprintf(stderr, "%s after %llu frames, %llu instructions; ram %016llx, screen %016llx\n",
+          in_sync ? "replayed" : "went out of sync", (unsigned long long)v.frames(),
+          (unsigned long long)v.counters.instructions, (unsigned long long)hash_bytes(v.ram, 0x10000),
+          (unsigned long long)screen);
+  u8 recorded_on = static_cast<u8>(v.recorded_on);
+  if (!in_sync && v.recorded_on != engine)
+    fprintf(stderr, "recorded with the %s engine, replayed with %s\n",
+            recorded_on < 5 ? ENGINES[recorded_on] : "unknown", ENGINES[static_cast<u8>(engine)]);
+  return in_sync ? 0 : 1;
+}
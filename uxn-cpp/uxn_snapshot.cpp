@@ -0,0 +1,281 @@
+#include "uxn_snapshot.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace uxn {
+
+namespace {
+
+constexpr u32 PAGE_SIZE = Snapshot::PAGE_SIZE, PAGES = Snapshot::PAGES;
+const u8 zero_page[PAGE_SIZE] = {0};
+
+const u8* page_data(const Snapshot::Page& p) { return p ? p.get() : zero_page; }
+
+Snapshot::Page copy_page(const u8* d) {
+  if (!memcmp(d, zero_page, PAGE_SIZE)) return nullptr;
+  u8* p = new u8[PAGE_SIZE];
+  memcpy(p, d, PAGE_SIZE);
+  return Snapshot::Page(p, std::default_delete<u8[]>());
+}
+
+// Bank pages are copied even if they're all zeros, since null stands for
+// a page that hasn't been written (which might read from the ROM).
+Snapshot::Page copy_bank_page(const u8* d) {
+  u8* p = new u8[PAGE_SIZE];
+  memcpy(p, d, PAGE_SIZE);
+  return Snapshot::Page(p, std::default_delete<u8[]>());
+}
+
+const Snapshot::BankPages* find_bank(const Snapshot* s, u16 index) {
+  if (s) for (const auto& b : s->banks) if (b.index == index) return &b;
+  return nullptr;
+}
+
+// The pages of `s`, for Uxn to compare the next snapshot with.
+Snapshot* share_pages(const Snapshot& s) {
+  Snapshot* base = new Snapshot;
+  for (u32 p = 0; p < PAGES; p++) base->ram[p] = s.ram[p];
+  base->banks = s.banks;
+  return base;
+}
+
+struct VectorWriter : StateWriter {
+  std::vector<u8>& out;
+  VectorWriter(std::vector<u8>& out) : out(out) {}
+  void write(const void* data, u32 length) final {
+    out.insert(out.end(), static_cast<const u8*>(data), static_cast<const u8*>(data) + length);
+  }
+};
+
+struct BufferReader : StateReader {
+  const u8* at;
+  size_t left;
+  BufferReader(const std::vector<u8>& in) : at(in.data()), left(in.size()) {}
+  bool read(void* data, u32 length) final {
+    if (length > left) return false;
+    memcpy(data, at, length);
+    at += length, left -= length;
+    return true;
+  }
+};
+
+}
+
+Snapshot* Uxn::snapshot() {
+  const Snapshot* base = static_cast<const Snapshot*>(snapshot_base);
+  Snapshot* s = new Snapshot;
+  for (u32 p = 0; p < PAGES; p++) {
+    const u8* d = ram + p * PAGE_SIZE;
+    if (base && !memcmp(d, page_data(base->ram[p]), PAGE_SIZE)) s->ram[p] = base->ram[p];
+    else s->ram[p] = copy_page(d);
+  }
+  if (banks) banks->each([&](u16 index, Bank& b) {
+    const Snapshot::BankPages* old = find_bank(base, index);
+    Snapshot::BankPages pages{index};
+    for (u32 p = 0; p < PAGES; p++) {
+      if (!b.pages[p]) continue;
+      if (old && !(b.written >> p & 1)) pages.pages[p] = old->pages[p];
+      else pages.pages[p] = copy_bank_page(b.pages[p]);
+    }
+    b.written = 0;
+    s->banks.push_back(pages);
+  });
+  memcpy(s->dev, dev, sizeof(s->dev));
+  s->wst = wst, s->rst = rst;
+  s->resume_pc = resume_pc;
+  VectorWriter out(s->devices);
+  save_devices(out);
+  delete snapshot_base;
+  snapshot_base = share_pages(*s);
+  return s;
+}
+
+bool Uxn::restore(const Snapshot& s) {
+  const Snapshot* base = static_cast<const Snapshot*>(snapshot_base);
+  for (u32 p = 0; p < PAGES; p++) {
+    u8* d = ram + p * PAGE_SIZE;
+    if (!memcmp(d, page_data(s.ram[p]), PAGE_SIZE)) continue;
+    memcpy(d, page_data(s.ram[p]), PAGE_SIZE);
+    ram_written(p * PAGE_SIZE, PAGE_SIZE);
+  }
+  if (banks) banks->each([&](u16 index, Bank&) { if (!find_bank(&s, index)) banks->drop(index); });
+  for (const auto& pages : s.banks) {
+    if (!banks) banks = new BankIndex1;
+    Bank& b = (*banks)[pages.index];
+    const Snapshot::BankPages* old = find_bank(base, pages.index);
+    for (u32 p = 0; p < PAGES; p++) {
+      if (!pages.pages[p]) {
+        b.drop(p);
+        continue;
+      }
+      if (b.pages[p] && old && !(b.written >> p & 1) && old->pages[p] == pages.pages[p]) continue;
+      if (!b.pages[p]) b.pages[p] = new u8[PAGE_SIZE];
+      memcpy(b.pages[p], pages.pages[p].get(), PAGE_SIZE);
+    }
+    b.written = 0;
+  }
+  memcpy(dev, s.dev, sizeof(s.dev));
+  wst = s.wst, rst = s.rst;
+  trace_rebase();
+  resume_pc = s.resume_pc;
+  queued_count = 0;
+  delete snapshot_base;
+  snapshot_base = share_pages(s);
+  BufferReader in(s.devices);
+  return load_devices(in);
+}
+
+/* File layout, little-endian, with the pages at a 4 KB boundary so they
+   can be mapped in place:
+
+     "UXNSNAP1"
+     u32 page size, u32 stored pages, u32 banks, u32 device state size,
+     u64 offset of the first stored page
+     dev[0x100], wst.dat[0x100], wst.ptr, rst.dat[0x100], rst.ptr,
+     u16 resume_pc
+     ram: 16 x u32 stored page index (~0 for zeros)
+     each bank: u16 index, 16 x u32 stored page index (~0 if unwritten)
+     device state
+     stored pages
+
+   Identical pages are stored once. */
+
+namespace {
+
+constexpr char MAGIC[8] = { 'U', 'X', 'N', 'S', 'N', 'A', 'P', '1' };
+constexpr u32 ZERO = ~0u;
+
+void put(std::vector<u8>& out, u64 v, u8 bytes) {
+  for (u8 i = 0; i < bytes; i++) out.push_back(v >> (i * 8));
+}
+
+u64 get(const u8*& at, u8 bytes) {
+  u64 v = 0;
+  for (u8 i = 0; i < bytes; i++) v |= static_cast<u64>(*at++) << (i * 8);
+  return v;
+}
+
+// Assigns stored page indices, one per distinct page.
+struct PageStore {
+  std::vector<const u8*> pages;
+  std::unordered_map<const u8*, u32> by_pointer;
+  std::unordered_map<u64, std::vector<u32>> by_hash;
+
+  u32 add(const Snapshot::Page& page) {
+    if (!page) return ZERO;
+    auto known = by_pointer.find(page.get());
+    if (known != by_pointer.end()) return known->second;
+    auto& same_hash = by_hash[hash_bytes(page.get(), PAGE_SIZE)];
+    for (u32 i : same_hash) {
+      if (memcmp(pages[i], page.get(), PAGE_SIZE)) continue;
+      by_pointer[page.get()] = i;
+      return i;
+    }
+    u32 i = pages.size();
+    pages.push_back(page.get());
+    same_hash.push_back(i);
+    by_pointer[page.get()] = i;
+    return i;
+  }
+};
+
+struct Mapping {
+  void* addr;
+  size_t size;
+  Mapping(void* addr, size_t size) : addr(addr), size(size) {}
+  ~Mapping() { munmap(addr, size); }
+};
+
+}
+
+bool Snapshot::save(const char* path) const {
+  PageStore store;
+  std::vector<u8> table;
+  for (u32 p = 0; p < PAGES; p++) put(table, store.add(ram[p]), 4);
+  for (const auto& b : banks) {
+    put(table, b.index, 2);
+    for (u32 p = 0; p < PAGES; p++) put(table, store.add(b.pages[p]), 4);
+  }
+
+  std::vector<u8> head(MAGIC, MAGIC + sizeof(MAGIC));
+  put(head, PAGE_SIZE, 4);
+  put(head, store.pages.size(), 4);
+  put(head, banks.size(), 4);
+  put(head, devices.size(), 4);
+  size_t fixed = head.size() + 8 + 0x100 + 0x101 + 0x101 + 2;
+  u64 pages_offset = (fixed + table.size() + devices.size() + PAGE_SIZE - 1) & ~static_cast<u64>(PAGE_SIZE - 1);
+  put(head, pages_offset, 8);
+  head.insert(head.end(), dev, dev + 0x100);
+  head.insert(head.end(), wst.dat, wst.dat + 0x100);
+  head.push_back(wst.ptr);
+  head.insert(head.end(), rst.dat, rst.dat + 0x100);
+  head.push_back(rst.ptr);
+  put(head, resume_pc, 2);
+  head.insert(head.end(), table.begin(), table.end());
+  head.insert(head.end(), devices.begin(), devices.end());
+  head.resize(pages_offset, 0);
+
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(head.data(), 1, head.size(), f) == head.size();
+  for (const u8* page : store.pages) ok = ok && fwrite(page, 1, PAGE_SIZE, f) == PAGE_SIZE;
+  return fclose(f) == 0 && ok;
+}
+
+Snapshot* Snapshot::load(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size > 0) addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return nullptr;
+  auto mapping = std::make_shared<Mapping>(addr, static_cast<size_t>(st.st_size));
+  const u8 *start = static_cast<const u8*>(addr), *at = start, *end = start + st.st_size;
+
+  size_t fixed = sizeof(MAGIC) + 16 + 8 + 0x100 + 0x101 + 0x101 + 2;
+  if (mapping->size < fixed || memcmp(at, MAGIC, sizeof(MAGIC))) return nullptr;
+  at += sizeof(MAGIC);
+  u32 page_size = get(at, 4), stored = get(at, 4), bank_count = get(at, 4), devices_size = get(at, 4);
+  u64 pages_offset = get(at, 8);
+  size_t table_size = PAGES * 4 + static_cast<size_t>(bank_count) * (2 + PAGES * 4);
+  if (page_size != PAGE_SIZE || pages_offset % PAGE_SIZE || fixed + table_size + devices_size > pages_offset ||
+      pages_offset + static_cast<u64>(stored) * PAGE_SIZE > mapping->size)
+    return nullptr;
+
+  Snapshot* s = new Snapshot;
+  memcpy(s->dev, at, 0x100), at += 0x100;
+  memcpy(s->wst.dat, at, 0x100), at += 0x100;
+  s->wst.ptr = *at++;
+  memcpy(s->rst.dat, at, 0x100), at += 0x100;
+  s->rst.ptr = *at++;
+  s->resume_pc = get(at, 2);
+  bool ok = true;
+  auto page = [&](u32 index) -> Page {
+    if (index == ZERO) return nullptr;
+    if (index >= stored) {
+      ok = false;
+      return nullptr;
+    }
+    return Page(mapping, start + pages_offset + static_cast<u64>(index) * PAGE_SIZE);
+  };
+  for (u32 p = 0; p < PAGES; p++) s->ram[p] = page(get(at, 4));
+  s->banks.resize(bank_count);
+  for (auto& b : s->banks) {
+    b.index = get(at, 2);
+    for (u32 p = 0; p < PAGES; p++) b.pages[p] = page(get(at, 4));
+  }
+  s->devices.assign(at, at + devices_size);
+  if (!ok || at + devices_size > end) {
+    delete s;
+    return nullptr;
+  }
+  return s;
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "uxn.hpp"
+#include <memory>
+#include <vector>
+
+namespace uxn {
+
+// The whole state of a Uxn: memory in 4 KB pages, which snapshots share
+// as long as they're unchanged, plus `dev`, the stacks, a vector cut short
+// by its budget, and whatever the devices saved (Uxn::save_devices).
+// Snapshots are immutable and can be restored into any number of machines
+// of the same kind, from any thread.
+//
+// Uxn::snapshot compares `ram` with the last snapshot a page at a time
+// (64 KB of memcmp, a few microseconds) rather than having every engine
+// track its stores; banks are only written by devices, through
+// Uxn::bank_write, which marks the pages. Either way only changed pages
+// are copied.
+class Snapshot : public SnapshotBase {
+public:
+  static constexpr u32 PAGE_SIZE = BANK_PAGE, PAGES = BANK_PAGES;
+
+  // PAGE_SIZE bytes, or null for a page of zeros.
+  using Page = std::shared_ptr<const u8>;
+
+  // Null bank pages are the ones not written since reset, so a snapshot
+  // only restores into a machine running the same ROM.
+  struct BankPages {
+    u16 index;
+    Page pages[PAGES];
+  };
+
+  Page ram[PAGES];
+  std::vector<BankPages> banks;
+  u8 dev[0x100];
+  Stack wst, rst;
+  u16 resume_pc;
+  std::vector<u8> devices;
+
+  // Writes the snapshot to `path`, storing each distinct page once, and
+  // reads one back. Pages of a loaded snapshot are mapped from the file
+  // rather than read. The device state is only meant for the build that
+  // saved it.
+  bool save(const char* path) const;
+  static Snapshot* load(const char* path);
+};
+
+}
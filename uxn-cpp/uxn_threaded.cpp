@@ -0,0 +1,116 @@
+#include "uxn.hpp"
+
+// Direct-threaded Uxn engine.
+//
+// Every one of the 256 opcodes gets its own handler, stamped out from the
+// `step` template below. The keep, return and short bits are template
+// constants, so SET/FLIP and the stack selection fold away at compile time,
+// and handlers jump straight to each other through a computed-goto table
+// instead of going back through a shared switch. Both stack pointers live
+// in locals for the whole run, and are only written back to `wst`/`rst`
+// around device calls (which may read or replace them) and at BRK.
+
+namespace uxn {
+
+#if defined(__GNUC__)
+
+namespace {
+
+struct Regs {
+  u8 *ram, *dev, *wd, *rd;
+  u8 wp, rp;
+  u16 pc;
+
+  void sync(Uxn& u) const { u.wst.ptr = wp; u.rst.ptr = rp; }
+  void load(const Uxn& u) { wp = u.wst.ptr; rp = u.rst.ptr; }
+};
+
+#define T *(s + *p)
+#define N *(s + (u8)(*p - 1))
+#define L *(s + (u8)(*p - 2))
+#define X *(s + (u8)(*p - 3))
+#define Y *(s + (u8)(*p - 4))
+#define Z *(s + (u8)(*p - 5))
+#define T2 (N << 8 | T)
+#define H2 (L << 8 | N)
+#define N2 (X << 8 | L)
+#define L2 (Z << 8 | Y)
+#define T2_(v) { r = (v); T = r; N = r >> 8; }
+#define N2_(v) { r = (v); L = r; X = r >> 8; }
+#define L2_(v) { r = (v); Y = r; Z = r >> 8; }
+#define FLIP      { s = R ? c.wd : c.rd; p = R ? &c.wp : &c.rp; }
+#define SHIFT(y)  { *p += (y); }
+#define SET(x, y) { SHIFT(K ? x + y : y) }
+
+#define DEI(d)    { c.sync(u); u.before_dei(d); c.load(u); }
+#define DEO(d)    { u8 _d = (d); c.sync(u); u.trace_deo(_d); u.after_deo(_d); c.load(u); }
+#define BRK       return false
+#define STORED(a)
+#define CALLED    { if (u.hle_at(pc)) { c.sync(u); u.hle_call(pc); c.load(u); } }
+#define JUMPED    u.trace_jump(pc, ins, c.wp, c.rp)
+
+// Runs one instruction; returns false on BRK.
+template <u8 ins>
+[[gnu::always_inline]] inline bool step(Uxn& u, Regs& c) {
+  constexpr bool K = ins & 0x80, R = ins & 0x40;
+  u8 *s = R ? c.rd : c.wd, *p = R ? &c.rp : &c.wp;
+  u8 *ram = c.ram, *dev = c.dev, *rr;
+  u16 &pc = c.pc, t, n, l, r;
+  switch(ins & 0x3f) {
+#include "uxn_ops.hpp"
+  }
+  return true;
+}
+
+}
+
+// Handler label names and opcode values are spelled as two hex digits.
+#define ROW(F, h) \
+  F(h##0) F(h##1) F(h##2) F(h##3) F(h##4) F(h##5) F(h##6) F(h##7) \
+  F(h##8) F(h##9) F(h##a) F(h##b) F(h##c) F(h##d) F(h##e) F(h##f)
+#define OPCODES(F) \
+  ROW(F, 0) ROW(F, 1) ROW(F, 2) ROW(F, 3) ROW(F, 4) ROW(F, 5) ROW(F, 6) ROW(F, 7) \
+  ROW(F, 8) ROW(F, 9) ROW(F, a) ROW(F, b) ROW(F, c) ROW(F, d) ROW(F, e) ROW(F, f)
+
+#define LABEL_ADDR(x) &&op_##x,
+#define HANDLER(x) op_##x: if (!step<0x##x>(u, c)) goto brk; DISPATCH;
+#define DISPATCH { \
+    if (Budgeted && !left--) goto out_of_budget; \
+    goto *table[c.ram[c.pc++]]; \
+  }
+
+namespace {
+
+// Not inlined or cloned: the label table must belong to the one copy.
+template <bool Budgeted>
+[[gnu::noinline, gnu::noclone]] void run(Uxn& u, u16 pc, Budget* budget) {
+  static void* const table[0x100] = { OPCODES(LABEL_ADDR) };
+  Regs c = { u.ram, u.dev, u.wst.dat, u.rst.dat, u.wst.ptr, u.rst.ptr, pc };
+  u32 left = Budgeted ? budget->left : 0;
+  DISPATCH;
+  OPCODES(HANDLER)
+out_of_budget:
+  if constexpr (Budgeted) left = 0, budget->pc = c.pc, budget->stopped = true;
+brk:
+  if constexpr (Budgeted) budget->left = left;
+  c.sync(u);
+}
+
+}
+
+bool Uxn::eval_threaded(u16 pc, Budget* budget) {
+  if (!initialized || !pc || dev[0x0f]) return 0;
+  if (budget) run<true>(*this, pc, budget);
+  else run<false>(*this, pc, nullptr);
+  return 1;
+}
+
+#else
+
+bool Uxn::eval_threaded(u16 pc, Budget* budget) {
+  return eval_switch(pc, budget);
+}
+
+#endif
+
+}
@@ -1,4 +1,9 @@
 #include "varvara.hpp"
+#if defined(__aarch64__) && defined(__ARM_NEON) && defined(UXN_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
 
 namespace uxn {
 
@@ -74,7 +79,7 @@ void Screen::after_deo(u8 d) {
     case 0x2e: {
       u8 ctrl = dev[0x2e];
       u8 color = ctrl & 0x3;
-      u8 *layer = ctrl & 0x40 ? fg : bg;
+      u8 layer = ctrl & 0x40 ? FG : BG;
       /* fill mode */
       if (ctrl & 0x80) {
         u16 x1, y1, x2, y2;
@@ -91,34 +96,17 @@ void Screen::after_deo(u8 d) {
       }
       /* pixel mode */
       else {
-        if (rX < w && rY < h)
-          layer[rX + rY * w] = color;
+        if (rX < w && rY < h) {
+          u8& p = layers[rX + rY * w];
+          p = (p & ~(3 << layer)) | color << layer;
+        }
         change(rX, rY, rX + 1, rY + 1);
         if (rMX) rX++;
         if (rMY) rY++;
       }
       return;
     }
-    case 0x2f: {
-      u8 i;
-      u8 ctrl = dev[0x2f];
-      u8 twobpp = !!(ctrl & 0x80);
-      u8 color = ctrl & 0xf;
-      u8 *layer = ctrl & 0x40 ? fg : bg;
-      int fx = ctrl & 0x10 ? -1 : 1;
-      int fy = ctrl & 0x20 ? -1 : 1;
-      u16 dxy = rDX * fy, dyx = rDY * fx, addr_incr = rMA << (1 + twobpp);
-      if (twobpp)
-        for (i = 0; i <= rML; i++, rA += addr_incr)
-          sprite_2bpp(layer, &uxn.ram[rA], rX + dyx * i, rY + dxy * i, color, fx, fy);
-      else
-        for (i = 0; i <= rML; i++, rA += addr_incr)
-          sprite_1bpp(layer, &uxn.ram[rA], rX + dyx * i, rY + dxy * i, color, fx, fy);
-      change(rX, rY, rX + dyx * rML + 8, rY + dxy * rML + 8);
-      if (rMX) rX += rDX * fx;
-      if (rMY) rY += rDY * fy;
-      return;
-    }
+    case 0x2f: sprite_run(dev[0x2f]); return;
   }
 }
 
@@ -127,11 +115,13 @@ void Screen::try_resize(u16 width, u16 height) {
     return;
   if (w == width && h == height)
     return;
-  delete[] bg;
-  delete[] fg;
-  bg = new u8[width * height], fg = new u8[width * height];
+  delete[] layers;
+  delete[] tiles;
+  layers = new u8[width * height];
   w = width, h = height;
-  fill(bg, 0), fill(fg, 0);
+  tiles_x = (w + TILE - 1) >> TILE_SHIFT, tiles_y = (h + TILE - 1) >> TILE_SHIFT;
+  tiles = new u8[tiles_x * tiles_y]();
+  clear();
   change(0, 0, width, height);
 }
 
@@ -140,63 +130,160 @@ void Screen::change(u16 x1, u16 y1, u16 x2, u16 y2) {
   if (y1 > h && y2 > y1) return;
   if (x1 > x2) x1 = 0;
   if (y1 > y2) y1 = 0;
-  if (x1 < screen_x1) screen_x1 = x1;
-  if (y1 < screen_y1) screen_y1 = y1;
-  if (x2 > screen_x2) screen_x2 = x2;
-  if (y2 > screen_y2) screen_y2 = y2;
+  if (x2 > w) x2 = w;
+  if (y2 > h) y2 = h;
   dirty = true;
+  if (x1 >= x2 || y1 >= y2) return;
+  u32 tx1 = x1 >> TILE_SHIFT, tx2 = (x2 - 1u) >> TILE_SHIFT, ty2 = (y2 - 1u) >> TILE_SHIFT;
+  for (u32 ty = y1 >> TILE_SHIFT; ty <= ty2; ty++)
+    __builtin_memset(tiles + ty * tiles_x + tx1, 1, tx2 - tx1 + 1);
 }
 
-void Screen::fill(u8 *layer, u8 color) {
-  size_t i, length = w * h;
-  for (i = 0; i < length; i++)
-    layer[i] = color;
+/* Rectangles and sprites are drawn 8 pixels at a time, as the bytes of a
+   u64 with the leftmost at the lowest address. */
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "rows are drawn as little-endian u64s");
+
+static constexpr u64 LANES = 0x0101010101010101ull;
+
+void Screen::clear() {
+  __builtin_memset(layers, 0, w * h);
   dirty = true;
 }
 
-void Screen::rect(u8 *layer, u16 x1, u16 y1, u16 x2, u16 y2, u8 color) {
-  size_t row, x, y;
-  for (y = y1; y < y2 && y < h; y++)
-    for (x = x1, row = y * w; x < x2 && x < w; x++)
-      layer[x + row] = color;
+void Screen::rect(u8 layer, u16 x1, u16 y1, u16 x2, u16 y2, u8 color) {
+  u8 keep = ~(3 << layer), set = color << layer;
+  u64 keep8 = keep * LANES, set8 = set * LANES;
+  if (x2 > w) x2 = w;
+  if (y2 > h) y2 = h;
+  for (u32 y = y1; y < y2; y++) {
+    u8* row = layers + y * w;
+    u32 x = x1;
+    for (; x + 8 <= x2; x += 8) {
+      u64 p;
+      __builtin_memcpy(&p, row + x, 8);
+      p = (p & keep8) | set8;
+      __builtin_memcpy(row + x, &p, 8);
+    }
+    for (; x < x2; x++) row[x] = (row[x] & keep) | set;
+  }
   dirty = true;
 }
 
-void Screen::sprite_2bpp(u8 *layer, const u8 *addr, u16 x1, u16 y1, u8 color, int fx, int fy) {
-  u8 opaque = blending[4][color];
-  u16 y, ymod = (fy < 0 ? 7 : 0), ymax = y1 + ymod + fy * 8;
-  u16 x, xmod = (fx > 0 ? 7 : 0), xmax = x1 + xmod - fx * 8;
-  for (y = y1 + ymod; y != ymax; y += fy, addr++) {
-    int c = addr[0] | (addr[8] << 8), row = y * w;
-    if (y < h)
-      for (x = x1 + xmod; x != xmax; x -= fx, c >>= 1) {
-        u8 ch = (c & 1) | ((c >> 7) & 2);
-        if (x < w && (opaque || ch))
-          layer[x + row] = blending[ch][color];
+/* Each sprite row is merged into its layer with a mask of the bits it
+   covers. Rows fully on screen take one load and store; only rows
+   crossing the right edge go pixel by pixel. The rows of the sprites
+   drawn lately stay expanded in Screen::sprite_cache, so a glyph or tile
+   drawn again is only the merges. */
+
+// Each bit of a sprite byte as a 0 or 1 byte, the high bit leftmost.
+struct SpriteBits {
+  u64 row[256];
+  constexpr SpriteBits() : row() {
+    for (u32 b = 0; b < 256; b++)
+      for (u32 i = 0; i < 8; i++) row[b] |= static_cast<u64>(b >> (7 - i) & 1) << (i * 8);
+  }
+};
+static constexpr SpriteBits sprite_bits;
+
+// Draws sprites of one color, layer and orientation: the colors a sprite
+// row writes (from its bitplanes `p0` and `p1`) into the layer's bits,
+// and the mask of the bits it writes.
+struct SpriteBlit {
+  u64 blend[4], opaque, bits;
+  bool twobpp, flipx, flipy;
+  // How the sprite is drawn, as kept in ExpandedSprite::style: never
+  // zero, so an empty cache entry matches nothing.
+  u16 style;
+
+  SpriteBlit(u8 layer, u8 color, bool twobpp, bool flipx, bool flipy)
+  : opaque(blending[4][color] ? ~0ull : 0), bits((3 << layer) * LANES), twobpp(twobpp), flipx(flipx), flipy(flipy),
+    style(0x100 | color | layer << 4 | twobpp << 6 | flipx << 7) {
+    for (u32 ch = 0; ch < 4; ch++) blend[ch] = blending[ch][color] << layer;
+  }
+  void expand(u8 p0, u8 p1, u64& value, u64& mask) const {
+    u64 e0 = sprite_bits.row[p0], e1 = sprite_bits.row[p1];
+    if (flipx) e0 = __builtin_bswap64(e0), e1 = __builtin_bswap64(e1);
+    u64 n0 = e0 ^ LANES, n1 = e1 ^ LANES;
+    mask = (opaque | (e0 | e1) * 0xff) & bits;
+    value = ((n0 & n1) * blend[0] + (e0 & n1) * blend[1] + (n0 & e1) * blend[2] + (e0 & e1) * blend[3]) & mask;
+  }
+  // The sprite at `addr` expanded, from `cache` if it was drawn the same
+  // way from the same bytes lately. A sprite changed in place misses.
+  const ExpandedSprite& expand_cached(ExpandedSprite* cache, const u8* addr) const {
+    u64 src[2] = { 0, 0 };
+    __builtin_memcpy(&src[0], addr, 8);
+    if (twobpp) __builtin_memcpy(&src[1], addr + 8, 8);
+    u64 hash = src[0] * 0x9e3779b97f4a7c15ull ^ src[1] * 0xc2b2ae3d27d4eb4full;
+    ExpandedSprite& e = cache[((hash >> 56) ^ style) % Screen::SPRITE_CACHE];
+    if (e.style == style && e.src[0] == src[0] && e.src[1] == src[1]) return e;
+    e.src[0] = src[0], e.src[1] = src[1], e.style = style;
+    for (u32 r = 0; r < 8; r++) expand(addr[r], twobpp ? addr[r + 8] : 0, e.value[r], e.mask[r]);
+    return e;
+  }
+  // `inside` says the sprite is wholly on the `w` x `h` screen.
+  void draw(u8* layers, u16 w, u16 h, ExpandedSprite* cache, const u8* addr, u16 x1, u16 y1, bool inside) const {
+    const ExpandedSprite& e = expand_cached(cache, addr);
+    if (inside) {
+      u8* at = layers + y1 * w + x1;
+      for (u32 r = 0; r < 8; r++) {
+        u64 old;
+        u8* row = at + (flipy ? 7 - r : r) * w;
+        __builtin_memcpy(&old, row, 8);
+        old = (old & ~e.mask[r]) | e.value[r];
+        __builtin_memcpy(row, &old, 8);
       }
+      return;
+    }
+    bool unclipped = w >= 8 && x1 <= w - 8;
+    for (u32 r = 0; r < 8; r++) {
+      u16 y = y1 + (flipy ? 7 - r : r);
+      if (y >= h) continue;
+      u64 value = e.value[r], mask = e.mask[r];
+      u8* row = layers + y * w;
+      if (unclipped) {
+        u64 old;
+        __builtin_memcpy(&old, row + x1, 8);
+        old = (old & ~mask) | value;
+        __builtin_memcpy(row + x1, &old, 8);
+        continue;
+      }
+      for (u32 i = 0; i < 8; i++) {
+        u16 x = x1 + i;
+        u8 m = mask >> (i * 8);
+        if (x < w) row[x] = (row[x] & ~m) | (value >> (i * 8) & m);
+      }
+    }
   }
+};
+
+void Screen::sprite(u8 layer, const u8 *addr, u16 x1, u16 y1, u8 color, bool twobpp, bool flipx, bool flipy) {
+  SpriteBlit(layer, color, twobpp, flipx, flipy).draw(layers, w, h, sprite_cache, addr, x1, y1, false);
   dirty = true;
 }
 
-void Screen::sprite_1bpp(u8 *layer, const u8 *addr, u16 x1, u16 y1, u8 color, int fx, int fy) {
-  u8 opaque = blending[4][color];
-  u16 y, ymod = (fy < 0 ? 7 : 0), ymax = y1 + ymod + fy * 8;
-  u16 x, xmod = (fx > 0 ? 7 : 0), xmax = x1 + xmod - fx * 8;
-  for (y = y1 + ymod; y != ymax; y += fy) {
-    int c = *addr++, row = y * w;
-    if (y < h)
-      for (x = x1 + xmod; x != xmax; x -= fx, c >>= 1) {
-        u8 ch = c & 1;
-        if (x < w && (opaque || ch))
-          layer[x + row] = blending[ch][color];
-      }
-  }
+/* The whole run shares one SpriteBlit, and is clipped once: when it lies
+   wholly on screen no sprite in it is checked against the edges. */
+void Screen::sprite_run(u8 ctrl) {
+  bool twobpp = ctrl & 0x80, flipx = ctrl & 0x10, flipy = ctrl & 0x20;
+  SpriteBlit blit(ctrl & 0x40 ? FG : BG, ctrl & 0xf, twobpp, flipx, flipy);
+  /* a run drawn leftwards or upwards ends where it started */
+  int x1 = rX, y1 = rY, x2 = rX + 8, y2 = rY + 8;
+  if (flipx) x1 -= rDY * rML; else x2 += rDY * rML;
+  if (flipy) y1 -= rDX * rML; else y2 += rDX * rML;
+  bool inside = x1 >= 0 && y1 >= 0 && x2 <= w && y2 <= h;
+  u16 dx = flipx ? -rDY : rDY, dy = flipy ? -rDX : rDX, step = rMA << (1 + twobpp);
+  u16 x = rX, y = rY;
+  for (u32 i = 0; i <= rML; i++, x += dx, y += dy, rA += step)
+    blit.draw(layers, w, h, sprite_cache, &uxn.ram[rA], x, y, inside);
   dirty = true;
+  change(x1, y1, x2, y2);
+  if (rMX) rX += flipx ? -rDX : rDX;
+  if (rMY) rY += flipy ? -rDY : rDY;
 }
 
 void Screen::draw_byte(u8 b, u16 x, u16 y, u8 color) {
-  sprite_1bpp(fg, &icons[(b >> 4) << 3], x, y, color, 1, 1);
-  sprite_1bpp(fg, &icons[(b & 0xf) << 3], x + 8, y, color, 1, 1);
+  sprite(FG, &icons[(b >> 4) << 3], x, y, color, false, false, false);
+  sprite(FG, &icons[(b & 0xf) << 3], x + 8, y, color, false, false, false);
   change(x, y, x + 0x10, y + 0x8);
 }
 
@@ -212,27 +299,254 @@ void Screen::debugger() {
     u8 color = i > 4 ? 0x01 : !pos ? 0xc : i == 4 ? 0x8 : 0x2;
     draw_byte(uxn.rst.dat[pos], i * 0x18 + 0x8, h - 0x10, color);
   }
-  sprite_1bpp(fg, &arrow[0], 0x68, h - 0x20, 3, 1, 1);
+  sprite(FG, &arrow[0], 0x68, h - 0x20, 3, false, false, false);
+  change(0x68, h - 0x20, 0x70, h - 0x18);
   for(i = 0; i < 0x20; i++)
     draw_byte(uxn.ram[i], (i & 0x7) * 0x18 + 0x8, ((i >> 3) << 3) + 0x8, 1 + !!uxn.ram[i]);
 }
 
+void Screen::save_state(StateWriter& out) const {
+  u16 regs[] = { w, h, rX, rY, rA, rMX, rMY, rMA, rML, rDX, rDY };
+  out.write(regs, sizeof(regs));
+  out.write(layers, w * h);
+}
+
+bool Screen::load_state(StateReader& in) {
+  u16 regs[11];
+  if (!in.read(regs, sizeof(regs))) return false;
+  try_resize(regs[0], regs[1]);
+  if (w != regs[0] || h != regs[1]) return false;
+  rX = regs[2], rY = regs[3], rA = regs[4];
+  rMX = regs[5], rMY = regs[6], rMA = regs[7], rML = regs[8], rDX = regs[9], rDY = regs[10];
+  if (!in.read(layers, w * h)) return false;
+  update_palette();
+  change(0, 0, w, h);
+  dirty = true;
+  return true;
+}
+
+/* Runs of changed tiles in a row become rectangles, and a run exactly
+   below one of those grows it downwards, so a changed area comes out as
+   a few rectangles whatever its shape. */
 void Screen::redraw() {
-  constexpr u8 palette_map[16] = { 0, 1, 2, 3, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 };
-  u16 x1 = screen_x1, y1 = screen_y1;
-  u16 x2 = screen_x2 > w ? w : screen_x2, y2 = screen_y2 > h ? h : screen_y2;
-  screen_x1 = screen_y1 = 0xffff;
-  screen_x2 = screen_y2 = 0;
   if (uxn.dev[0x0e])
     debugger();
-  for (u16 y = y1; y < y2; y++) {
-    for (u16 x = x1; x < x2; x++) {
-      const size_t i = y * w + x;
-      on_pixel(x, y, palette_map[fg[i] << 2 | bg[i]]);
+  painted_count = 0;
+  for (u32 ty = 0; ty < tiles_y; ty++) {
+    u8* row = tiles + ty * tiles_x;
+    for (u32 tx = 0; tx < tiles_x; tx++) {
+      if (!row[tx]) continue;
+      u32 end = tx;
+      while (end < tiles_x && row[end]) row[end++] = 0;
+      u32 x2 = end << TILE_SHIFT, y2 = (ty + 1) << TILE_SHIFT;
+      add_painted(tx << TILE_SHIFT, ty << TILE_SHIFT, x2 < w ? x2 : w, y2 < h ? y2 : h);
+      tx = end;
+    }
+  }
+  compose(painted, painted_count);
+}
+
+void Screen::compose_rows(const Rect* rects, u32 count, u16 y1, u16 y2) {
+  for (u32 i = 0; i < count; i++) {
+    const Rect& r = rects[i];
+    u16 from = r.y > y1 ? r.y : y1, to = r.y + r.h < y2 ? r.y + r.h : y2;
+    for (u16 y = from; y < to; y++)
+      on_span(y, r.x, r.x + r.w, layers + y * w + r.x);
+  }
+}
+
+void Screen::add_painted(u16 x1, u16 y1, u16 x2, u16 y2) {
+  for (u32 i = 0; i < painted_count; i++) {
+    Rect& r = painted[i];
+    if (r.x == x1 && r.w == x2 - x1 && r.y + r.h == y1) {
+      r.h = y2 - r.y;
+      return;
     }
   }
+  if (painted_count == MAX_RECTS) {
+    Rect& r = painted[MAX_RECTS - 1];
+    u16 rx2 = r.x + r.w, ry2 = r.y + r.h;
+    r.x = r.x < x1 ? r.x : x1, r.y = r.y < y1 ? r.y : y1;
+    r.w = (rx2 > x2 ? rx2 : x2) - r.x, r.h = (ry2 > y2 ? ry2 : y2) - r.y;
+    return;
+  }
+  painted[painted_count++] = { x1, y1, static_cast<u16>(x2 - x1), static_cast<u16>(y2 - y1) };
 }
 
+/* Spans of 16 pixels or more are looked up 16 at a time: each byte of
+   the 16 table pixels becomes a 16-byte table of its own, the layers
+   index all of them with one byte shuffle each, and the results are
+   interleaved back into pixels. That's SSSE3 on x86-64 when the CPU has
+   it, and NEON on 64-bit ARM with UXN_NEON defined. The NEON path hasn't
+   been checked against the scalar one on hardware yet, so it's opt-in. */
+#if defined(__aarch64__) && defined(__ARM_NEON) && defined(UXN_NEON)
+template <u32 Size>
+static u32 compose_simd(u8* out, const u8* src, u32 n, const u8* table) {
+  u8 planes[Size][16];
+  for (u32 i = 0; i < 16; i++)
+    for (u32 k = 0; k < Size; k++) planes[k][i] = table[i * Size + k];
+  uint8x16_t p0 = vld1q_u8(planes[0]), p1 = vld1q_u8(planes[1]);
+  u32 i = 0;
+  for (; i + 16 <= n; i += 16, out += 16 * Size) {
+    uint8x16_t v = vld1q_u8(src + i);
+    if constexpr (Size == 2) {
+      uint8x16x2_t pixels = {{ vqtbl1q_u8(p0, v), vqtbl1q_u8(p1, v) }};
+      vst2q_u8(out, pixels);
+    } else {
+      uint8x16_t p2 = vld1q_u8(planes[2]), p3 = vld1q_u8(planes[3]);
+      uint8x16x4_t pixels = {{ vqtbl1q_u8(p0, v), vqtbl1q_u8(p1, v), vqtbl1q_u8(p2, v), vqtbl1q_u8(p3, v) }};
+      vst4q_u8(out, pixels);
+    }
+  }
+  return i;
+}
+static bool have_simd() { return true; }
+#elif defined(__x86_64__)
+template <u32 Size>
+[[gnu::target("ssse3")]] static u32 compose_simd(u8* out, const u8* src, u32 n, const u8* table) {
+  alignas(16) u8 planes[Size][16];
+  for (u32 i = 0; i < 16; i++)
+    for (u32 k = 0; k < Size; k++) planes[k][i] = table[i * Size + k];
+  __m128i p0 = _mm_load_si128(reinterpret_cast<const __m128i*>(planes[0]));
+  __m128i p1 = _mm_load_si128(reinterpret_cast<const __m128i*>(planes[1]));
+  u32 i = 0;
+  for (; i + 16 <= n; i += 16, out += 16 * Size) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i b0 = _mm_shuffle_epi8(p0, v), b1 = _mm_shuffle_epi8(p1, v);
+    __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+    __m128i* o = reinterpret_cast<__m128i*>(out);
+    if constexpr (Size == 2) {
+      _mm_storeu_si128(o, lo01);
+      _mm_storeu_si128(o + 1, hi01);
+    } else {
+      __m128i p2 = _mm_load_si128(reinterpret_cast<const __m128i*>(planes[2]));
+      __m128i p3 = _mm_load_si128(reinterpret_cast<const __m128i*>(planes[3]));
+      __m128i b2 = _mm_shuffle_epi8(p2, v), b3 = _mm_shuffle_epi8(p3, v);
+      __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+      _mm_storeu_si128(o, _mm_unpacklo_epi16(lo01, lo23));
+      _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo01, lo23));
+      _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi01, hi23));
+      _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi01, hi23));
+    }
+  }
+  return i;
+}
+static bool have_simd() {
+  static const bool ssse3 = __builtin_cpu_supports("ssse3");
+  return ssse3;
+}
+#else
+template <u32 Size>
+static u32 compose_simd(u8* out, const u8* src, u32 n, const u8* table) { return 0; }
+static bool have_simd() { return false; }
+#endif
+
+template <u32 Size>
+void compose_span(u8* out, const u8* src, u32 n, const u8* table) {
+  u32 i = n >= 16 && have_simd() ? compose_simd<Size>(out, src, n, table) : 0;
+  for (out += i * Size; i < n; i++, out += Size) __builtin_memcpy(out, table + src[i] * Size, Size);
+}
+
+template void compose_span<2>(u8* out, const u8* src, u32 n, const u8* table);
+template void compose_span<4>(u8* out, const u8* src, u32 n, const u8* table);
+
+/* Widening repeats each pixel `zoom` times. Zooms 2 to 4 go a vector at a
+   time: SSE2 (which every x86-64 has) unpacks it with itself, for zooms 2
+   and 4, and with UXN_NEON (opt-in, as for compose_simd) NEON stores a
+   vector interleaved with itself. */
+#if defined(__aarch64__) && defined(__ARM_NEON) && defined(UXN_NEON)
+template <u32 Size>
+static u32 widen_simd(u8* out, const u8* src, u32 n, u8 zoom) {
+  u32 i = 0;
+  if constexpr (Size == 2) {
+    const u16* s = reinterpret_cast<const u16*>(src);
+    u16* o = reinterpret_cast<u16*>(out);
+    for (; zoom == 2 && i + 8 <= n; i += 8) {
+      uint16x8_t v = vld1q_u16(s + i);
+      uint16x8x2_t pixels = {{ v, v }};
+      vst2q_u16(o + i * 2, pixels);
+    }
+    for (; zoom == 3 && i + 8 <= n; i += 8) {
+      uint16x8_t v = vld1q_u16(s + i);
+      uint16x8x3_t pixels = {{ v, v, v }};
+      vst3q_u16(o + i * 3, pixels);
+    }
+    for (; zoom == 4 && i + 8 <= n; i += 8) {
+      uint16x8_t v = vld1q_u16(s + i);
+      uint16x8x4_t pixels = {{ v, v, v, v }};
+      vst4q_u16(o + i * 4, pixels);
+    }
+  } else {
+    const u32* s = reinterpret_cast<const u32*>(src);
+    u32* o = reinterpret_cast<u32*>(out);
+    for (; zoom == 2 && i + 4 <= n; i += 4) {
+      uint32x4_t v = vld1q_u32(s + i);
+      uint32x4x2_t pixels = {{ v, v }};
+      vst2q_u32(o + i * 2, pixels);
+    }
+    for (; zoom == 3 && i + 4 <= n; i += 4) {
+      uint32x4_t v = vld1q_u32(s + i);
+      uint32x4x3_t pixels = {{ v, v, v }};
+      vst3q_u32(o + i * 3, pixels);
+    }
+    for (; zoom == 4 && i + 4 <= n; i += 4) {
+      uint32x4_t v = vld1q_u32(s + i);
+      uint32x4x4_t pixels = {{ v, v, v, v }};
+      vst4q_u32(o + i * 4, pixels);
+    }
+  }
+  return i;
+}
+#elif defined(__x86_64__)
+template <u32 Size>
+static u32 widen_simd(u8* out, const u8* src, u32 n, u8 zoom) {
+  constexpr u32 lanes = 16 / Size;
+  if (zoom != 2 && zoom != 4) return 0;
+  u32 i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * Size));
+    __m128i* o = reinterpret_cast<__m128i*>(out + i * Size * zoom);
+    __m128i lo, hi;
+    if constexpr (Size == 2) lo = _mm_unpacklo_epi16(v, v), hi = _mm_unpackhi_epi16(v, v);
+    else lo = _mm_unpacklo_epi32(v, v), hi = _mm_unpackhi_epi32(v, v);
+    if (zoom == 2) {
+      _mm_storeu_si128(o, lo);
+      _mm_storeu_si128(o + 1, hi);
+    } else if constexpr (Size == 2) {
+      _mm_storeu_si128(o, _mm_unpacklo_epi32(lo, lo));
+      _mm_storeu_si128(o + 1, _mm_unpackhi_epi32(lo, lo));
+      _mm_storeu_si128(o + 2, _mm_unpacklo_epi32(hi, hi));
+      _mm_storeu_si128(o + 3, _mm_unpackhi_epi32(hi, hi));
+    } else {
+      _mm_storeu_si128(o, _mm_unpacklo_epi64(lo, lo));
+      _mm_storeu_si128(o + 1, _mm_unpackhi_epi64(lo, lo));
+      _mm_storeu_si128(o + 2, _mm_unpacklo_epi64(hi, hi));
+      _mm_storeu_si128(o + 3, _mm_unpackhi_epi64(hi, hi));
+    }
+  }
+  return i;
+}
+#else
+template <u32 Size>
+static u32 widen_simd(u8* out, const u8* src, u32 n, u8 zoom) { return 0; }
+#endif
+
+template <u32 Size>
+void scale_rect(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u16 w, u16 h, u8 zoom) {
+  u32 row = w * zoom * Size;
+  for (u32 y = 0; y < h; y++, src += src_stride) {
+    u8* out = dst;
+    u32 i = widen_simd<Size>(out, src, w, zoom);
+    for (out += i * zoom * Size; i < w; i++)
+      for (u8 k = 0; k < zoom; k++, out += Size) __builtin_memcpy(out, src + i * Size, Size);
+    for (u8 k = 1; k < zoom; k++) __builtin_memcpy(dst + k * dst_stride, dst, row);
+    dst += zoom * dst_stride;
+  }
+}
+
+template void scale_rect<2>(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u16 w, u16 h, u8 zoom);
+template void scale_rect<4>(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u16 w, u16 h, u8 zoom);
+
 ////////////////////////////////////////////////////////////
 // AUDIO
 
@@ -448,6 +762,29 @@ static inline float calc_duration(u16 len, u8 pitch) {
   return len / (scale * 44.1f);
 }
 
+/* Sample data points into ram, so it's kept as an offset. */
+void Audio::save_state(StateWriter& out) const {
+  for (const AudioChannel& c : channel) {
+    AudioChannel copy = c;
+    u32 offsets[2] = { ~0u, ~0u };
+    if (c.sample.data) offsets[0] = c.sample.data - uxn.ram;
+    if (c.next_sample.data) offsets[1] = c.next_sample.data - uxn.ram;
+    copy.sample.data = copy.next_sample.data = nullptr;
+    out.write(&copy, sizeof(copy));
+    out.write(offsets, sizeof(offsets));
+  }
+}
+
+bool Audio::load_state(StateReader& in) {
+  for (AudioChannel& c : channel) {
+    u32 offsets[2];
+    if (!in.read(&c, sizeof(c)) || !in.read(offsets, sizeof(offsets))) return false;
+    c.sample.data = offsets[0] < 0x10000 ? uxn.ram + offsets[0] : nullptr;
+    c.next_sample.data = offsets[1] < 0x10000 ? uxn.ram + offsets[1] : nullptr;
+  }
+  return true;
+}
+
 void Audio::start(u8 instance) {
   u8* d = &uxn.dev[(3 + instance) << 4];
   u16 dur = peek2(d + 0x5);
@@ -533,8 +870,9 @@ void Filesystem::after_deo(u8 d) {
     case 0xa5: {
       read_state = ReadState::NotReading;
       dir_entry_end = dir_entry_start = 0;
-      u16 len = peek2(dev + 0xaa);
-      stat().write(uxn.bounded_range_in_ram_mutable(peek2(dev + 0xa4), len));
+      u16 len = peek2(dev + 0xaa), addr = peek2(dev + 0xa4);
+      stat().write(uxn.bounded_range_in_ram_mutable(addr, len));
+      uxn.ram_written(addr, len);
       poke2(dev + 0xa2, len);
       return;
     }
@@ -584,6 +922,7 @@ void Filesystem::after_deo(u8 d) {
           success = i;
         }
       }
+      uxn.ram_written(addr, success);
       poke2(dev + 0xa2, success);
       return;
     }
@@ -597,6 +936,19 @@ void Filesystem::after_deo(u8 d) {
   }
 }
 
+void Filesystem::save_state(StateWriter& out) const {
+  out.write(open_filename, sizeof(open_filename));
+}
+
+bool Filesystem::load_state(StateReader& in) {
+  close();
+  read_state = ReadState::NotReading;
+  dir_entry_end = dir_entry_start = 0;
+  if (!in.read(open_filename, sizeof(open_filename))) return false;
+  open_filename[UXN_PATH_MAX - 1] = '\0';
+  return true;
+}
+
 void Filesystem::write_dir_entry(Stat stat) {
   dir_entry_start = 0;
   stat.write({ (u8*)dir_entry, 4 });
@@ -623,9 +975,113 @@ bool Varvara::init() {
   return Uxn::init();
 }
 
+void Varvara::save_devices(StateWriter& out) {
+  base_screen->save_state(out);
+  base_audio->save_state(out);
+  base_file->save_state(out);
+}
+
+bool Varvara::load_devices(StateReader& in) {
+  return base_screen->load_state(in) && base_audio->load_state(in) && base_file->load_state(in);
+}
+
 void Varvara::reset(bool soft) {
+  if (recording) {
+    Event e;
+    e.type = Event::Reset, e.port = soft;
+    log(e);
+  }
+  if (boot_rom_filename) {
+    size_t sz;
+    if (base_file->reload(boot_rom, sz)) boot_rom_size = static_cast<u32>(sz);
+  }
   Uxn::reset(soft);
   base_screen->reset();
+  __builtin_memcpy(recorded_dev, dev, sizeof(recorded_dev));
+}
+
+static inline u32 peek4(const u8* d) {
+  return static_cast<u32>(d[0]) << 24 | d[1] << 16 | d[2] << 8 | d[3];
+}
+
+static inline void poke4(u8* d, u32 v) {
+  poke2(d, v >> 16);
+  poke2(d + 2, v);
+}
+
+u32 Event::encode(u8* out) const {
+  poke4(out, frame);
+  out[4] = type;
+  out[5] = port;
+  switch (type) {
+    case Ports: __builtin_memcpy(out + 6, data, 16); return 22;
+    case Run: poke2(out + 6, pc), poke4(out + 8, count), out[12] = data[0]; return 13;
+    case Read: out[6] = data[0]; return 7;
+    default: return 6;
+  }
+}
+
+u32 Event::decode(const u8* in, u32 size, Event& e) {
+  if (size < 6) return 0;
+  e.frame = peek4(in);
+  e.type = static_cast<Type>(in[4]);
+  e.port = in[5];
+  switch (e.type) {
+    case Ports:
+      if (size < 22) return 0;
+      __builtin_memcpy(e.data, in + 6, 16);
+      return 22;
+    case Run:
+      if (size < 13) return 0;
+      e.pc = in[6] << 8 | in[7], e.count = peek4(in + 8), e.data[0] = in[12];
+      return 13;
+    case Read:
+      if (size < 7) return 0;
+      e.data[0] = in[6];
+      return 7;
+    case Reset: return 6;
+    default: return 0;
+  }
+}
+
+void Varvara::record(StateWriter* out) {
+  recording = out;
+  if (!out) return;
+  if (!vector_budget) vector_budget = ~0u;
+  u8 header[Event::HEADER_SIZE] = { 'U', 'X', 'N', 'R', 'E', 'C', '2', '\n' };
+  poke2(header + 8, base_screen->width());
+  poke2(header + 10, base_screen->height());
+  header[12] = static_cast<u8>(hle);
+  header[13] = static_cast<u8>(engine);
+  out->write(header, sizeof(header));
+  // Whatever the host set up beforehand is logged with the first run.
+  __builtin_memset(recorded_dev, 0, sizeof(recorded_dev));
+}
+
+void Varvara::log(const Event& e) {
+  u8 buf[Event::MAX_SIZE];
+  Event tagged = e;
+  tagged.frame = base_screen->frames;
+  recording->write(buf, tagged.encode(buf));
+}
+
+void Varvara::before_run(u16 pc) {
+  if (!recording) return;
+  for (u32 d = 0; d < 0x100; d += 0x10) {
+    if (!__builtin_memcmp(dev + d, recorded_dev + d, 0x10)) continue;
+    Event e;
+    e.type = Event::Ports, e.port = d;
+    __builtin_memcpy(e.data, dev + d, 0x10);
+    log(e);
+  }
+}
+
+void Varvara::after_run(u16 pc, u32 instructions, bool finished) {
+  if (!recording) return;
+  Event e;
+  e.type = Event::Run, e.pc = pc, e.count = instructions, e.data[0] = finished;
+  log(e);
+  __builtin_memcpy(recorded_dev, dev, sizeof(recorded_dev));
 }
 
 void Varvara::before_dei(u8 d) {
@@ -641,30 +1097,105 @@ void Varvara::before_dei(u8 d) {
     // Datetime
     else if (d >= 0xc0 && d <= 0xcf) dev[d] = base_datetime->datetime_byte(d & 0xf);
   }
+  if (recording && reads_host(d)) {
+    Event e;
+    e.type = Event::Read, e.port = d, e.data[0] = dev[d];
+    log(e);
+  }
+}
+
+/* The expansion copies go one byte at a time in their direction, so a
+   copy onto itself shifted by d bytes repeats the first d bytes. These
+   give the same result with bulk copies, d bytes at a time when the
+   source runs into the destination. */
+static void copy_ascending(u8* dst, const u8* src, u32 n) {
+  uintptr_t d = reinterpret_cast<uintptr_t>(dst) - reinterpret_cast<uintptr_t>(src);
+  if (d == 0 || d >= n) {
+    __builtin_memmove(dst, src, n);
+    return;
+  }
+  for (u32 k = 0; k < n; k += d) __builtin_memcpy(dst + k, src + k, n - k < d ? n - k : d);
+}
+
+static void copy_descending(u8* dst, const u8* src, u32 n) {
+  uintptr_t d = reinterpret_cast<uintptr_t>(src) - reinterpret_cast<uintptr_t>(dst);
+  if (d == 0 || d >= n) {
+    __builtin_memmove(dst, src, n);
+    return;
+  }
+  for (u32 k = n; k > 0; k -= k < d ? k : d) {
+    u32 m = k < d ? k : d;
+    __builtin_memcpy(dst + k - m, src + k - m, m);
+  }
+}
+
+/* Commands, at `addr` in ram:
+     0x00 fill:       length*, bank*, addr*, value
+     0x01 copy left:  length*, src bank*, src addr*, dst bank*, dst addr*
+     0x02 copy right: the same, copying from the last byte to the first
+   Addresses wrap around within their bank. Banks are worked on a page at
+   a time, and each span a bulk memset or memmove. */
+void Varvara::expansion(u16 addr) {
+  u8 op = ram[addr];
+  if (op > 0x02 || addr > 0x10000 - (op == 0x00 ? 8 : 11)) return;
+  u8* cmd = ram + addr + 1;
+  u16 length = peek2(cmd);
+  u16 a_bank = peek2(cmd + 2), a_addr = peek2(cmd + 4);
+  if (op == 0x00) {
+    u8 value = cmd[6];
+    for (u32 i = 0; i < length;) {
+      u16 a = a_addr + i;
+      u32 n = length - i;
+      if (n > BANK_PAGE - a % BANK_PAGE) n = BANK_PAGE - a % BANK_PAGE;
+      __builtin_memset(bank_write(a_bank, a), value, n);
+      if (!a_bank) ram_written(a, n);
+      i += n;
+    }
+    return;
+  }
+  u16 b_bank = peek2(cmd + 6), b_addr = peek2(cmd + 8);
+  // The destination page is looked up first, so that if it's also the
+  // source, both are the copy that gets written.
+  if (op == 0x01) {
+    for (u32 i = 0; i < length;) {
+      u16 a = a_addr + i, b = b_addr + i;
+      u32 n = length - i;
+      if (n > BANK_PAGE - a % BANK_PAGE) n = BANK_PAGE - a % BANK_PAGE;
+      if (n > BANK_PAGE - b % BANK_PAGE) n = BANK_PAGE - b % BANK_PAGE;
+      u8* dst = bank_write(b_bank, b);
+      copy_ascending(dst, bank_read(a_bank, a), n);
+      if (!b_bank) ram_written(b, n);
+      i += n;
+    }
+  } else {
+    for (u32 left = length; left > 0;) {
+      u16 a_last = a_addr + left - 1, b_last = b_addr + left - 1;
+      u32 n = left;
+      if (n > a_last % BANK_PAGE + 1u) n = a_last % BANK_PAGE + 1;
+      if (n > b_last % BANK_PAGE + 1u) n = b_last % BANK_PAGE + 1;
+      u16 a = a_last - (n - 1), b = b_last - (n - 1);
+      u8* dst = bank_write(b_bank, b);
+      copy_descending(dst, bank_read(a_bank, a), n);
+      if (!b_bank) ram_written(b, n);
+      left -= n;
+    }
+  }
 }
 
 void Varvara::after_deo(u8 d) {
   switch (d) {
     // System
-    case 0x03: {
-      u16 addr = peek2(dev + 0x02);
-      if (ram[addr] == 0x1 && addr <= 0x10000 - 10) {
-        u8* cmd_addr = ram + addr + 1;
-        u16 i, length = peek2(cmd_addr);
-        u16 a_bank = peek2(cmd_addr + 2), a_addr = peek2(cmd_addr + 4);
-        u16 b_bank = peek2(cmd_addr + 6), b_addr = peek2(cmd_addr + 8);
-        u8 *src = bank(a_bank), *dst = bank(b_bank);
-        for (i = 0; i < length; i++)
-          dst[(b_addr + i) & 0xffff] = src[(a_addr + i) & 0xffff];
-      }
-      return;
-    }
-    case 0x04: wst.ptr = dev[0x04]; return;
-    case 0x05: rst.ptr = dev[0x05]; return;
+    case 0x03: expansion(peek2(dev + 0x02)); return;
+    case 0x04: wst.ptr = dev[0x04]; trace_rebase(); return;
+    case 0x05: rst.ptr = dev[0x05]; trace_rebase(); return;
     case 0x09:
     case 0x0b:
     case 0x0d: base_screen->update_palette(); return;
-    case 0x0e: on_system_debug(dev[0x0e]); return;
+    case 0x0e:
+      on_system_debug(dev[0x0e]);
+      if (tracing()) on_trace(TraceReason::Request);
+      return;
+    case 0x0f: if (dev[0x0f] && tracing()) on_trace(TraceReason::Halt); return;
     default:
     // Screen
     if (d >= 0x20 && d <= 0x2f) base_screen->after_deo(d);
@@ -44,11 +44,43 @@ public:
 ////////////////////////////////////////////////////////////
 // SCREEN
 
+// Turns `n` bytes of packed layers (see Screen::layers) into pixels of
+// `Size` bytes (2 or 4), looking each up in the 16 pixels at `table`.
+template <u32 Size>
+void compose_span(u8* out, const u8* src, u32 n, const u8* table);
+
+// Scales `w` x `h` pixels of `Size` bytes (2 or 4) up by `zoom` in both
+// directions, from rows `src_stride` bytes apart at `src` to rows
+// `dst_stride` bytes apart at `dst`. Each source row is widened once and
+// the result copied to the zoom - 1 rows below it.
+template <u32 Size>
+void scale_rect(u8* dst, u32 dst_stride, const u8* src, u32 src_stride, u16 w, u16 h, u8 zoom);
+
+// A sprite's 8 rows as drawn into a layer: the bits each row sets, and
+// the mask of the bits it writes. Screen keeps the ones it drew lately,
+// keyed by their source bytes and how they were drawn.
+struct ExpandedSprite {
+  u64 src[2];
+  u16 style;
+  u64 value[8], mask[8];
+};
+
 class Screen {
 public:
+  // Part of the screen, in pixels.
+  struct Rect {
+    u16 x, y, w, h;
+  };
+  // Changes are tracked in tiles of TILE x TILE pixels, and a repaint
+  // covers them with at most MAX_RECTS rectangles.
+  static constexpr u32 TILE_SHIFT = 4, TILE = 1 << TILE_SHIFT, MAX_RECTS = 32;
+  // Entries in the cache of expanded sprites.
+  static constexpr u32 SPRITE_CACHE = 256;
+
   virtual ~Screen() {
-    if (fg) delete[] fg;
-    if (bg) delete[] bg;
+    delete[] layers;
+    delete[] tiles;
+    delete[] sprite_cache;
   }
 
   u16 width() const { return w; }
@@ -59,24 +91,34 @@ public:
     return true;
   }
   virtual void reset() {
-    fill(bg, 0), fill(fg, 0);
+    clear();
     change(0, 0, w, h);
     update_palette();
   }
   virtual void update_palette() = 0;
+  // Calls to frame() so far.
+  u32 frames = 0;
+
   bool frame() {
+    frames++;
     bool did_run = uxn.call_vec(0x20);
+    present();
+    return did_run;
+  }
+  // Repaints if anything changed since the last time.
+  void present() {
     if (dirty) {
       repaint();
       dirty = false;
     }
-    return did_run;
   }
   virtual void repaint() = 0;
   virtual void try_resize(u16 width, u16 height);
 
   void before_dei(u8 d);
   void after_deo(u8 d);
+  void save_state(StateWriter& out) const;
+  bool load_state(StateReader& in);
 
 protected:
   Uxn& uxn;
@@ -86,23 +128,51 @@ protected:
   /* screen registers */
   u16 rX = 0, rY = 0, rA = 0, rMX = 0, rMY = 0, rMA = 0, rML = 0, rDX = 0, rDY = 0;
 
-  Screen(Uxn& uxn, u16 width, u16 height) : uxn(uxn), w(width), h(height), fg(new u8[w*h]), bg(new u8[w*h]) {}
+  Screen(Uxn& uxn, u16 width, u16 height)
+  : uxn(uxn), w(width), h(height), layers(new u8[w*h]),
+    tiles_x((w + TILE - 1) >> TILE_SHIFT), tiles_y((h + TILE - 1) >> TILE_SHIFT), tiles(new u8[tiles_x * tiles_y]()),
+    sprite_cache(new ExpandedSprite[SPRITE_CACHE]()) {}
   virtual void on_resize() = 0;
-  virtual void on_pixel(u16 x, u16 y, u8 color) = 0;
+  // Composites pixels x1 to x2 - 1 of row y from their packed layers
+  // `src`; palette_map gives the palette color for each.
+  virtual void on_span(u16 y, u16 x1, u16 x2, const u8* src) = 0;
+  static constexpr u8 palette_map[16] = { 0, 1, 2, 3, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 };
 
-  void fill(u8 *layer, u8 color);
+  void clear();
   void change(u16 x1, u16 y1, u16 x2, u16 y2);
+  // Composites the tiles that changed, and lists them in `painted`. The
+  // last rectangle can take in more than changed, once there are
+  // MAX_RECTS of them.
   void redraw();
+  Rect painted[MAX_RECTS];
+  u32 painted_count = 0;
+  // Composites `rects` for redraw. Frontends with cores to spare can
+  // split the rows up between threads: see BandedScreen.
+  virtual void compose(const Rect* rects, u32 count) { compose_rows(rects, count, 0, h); }
+  // Composites rows y1 to y2 - 1 of `rects` through on_span.
+  void compose_rows(const Rect* rects, u32 count, u16 y1, u16 y2);
 
 private:
-  u16 screen_x1, screen_y1, screen_x2, screen_y2;
-  u8 *fg, *bg;
-
-  void rect(u8 *layer, u16 x1, u16 y1, u16 x2, u16 y2, u8 color);
-  void sprite_2bpp(u8 *layer, const u8 *addr, u16 x1, u16 y1, u8 color, int fx, int fy);
-  void sprite_1bpp(u8 *layer, const u8 *addr, u16 x1, u16 y1, u8 color, int fx, int fy);
+  // Both layers, a byte per pixel: the foreground color in bits 2-3 and
+  // the background in bits 0-1, so compositing a pixel is one lookup.
+  // Drawing takes the shift of the layer it draws on.
+  u8 *layers;
+  static constexpr u8 BG = 0, FG = 2;
+  // A byte per tile, set when anything in it changed since redraw.
+  u16 tiles_x, tiles_y;
+  u8 *tiles;
+  // Sprites drawn lately, by a hash of their bytes and style.
+  ExpandedSprite *sprite_cache;
+
+  void rect(u8 layer, u16 x1, u16 y1, u16 x2, u16 y2, u8 color);
+  // An 8x8 sprite from 8 bytes (1bpp) or two planes of 8 (2bpp) at `addr`.
+  void sprite(u8 layer, const u8 *addr, u16 x1, u16 y1, u8 color, bool twobpp, bool flipx, bool flipy);
+  // The sprite port: rML + 1 sprites as `ctrl` says, from rA on, each
+  // rDY across or rDX down from the one before.
+  void sprite_run(u8 ctrl);
   void draw_byte(u8 b, u16 x, u16 y, u8 color);
   void debugger();
+  void add_painted(u16 x1, u16 y1, u16 x2, u16 y2);
 };
 
 class DummyScreen : public Screen {
@@ -115,7 +185,7 @@ public:
   void try_resize(u16 width, u16 height) final {}
 protected:
   void on_resize() final {}
-  void on_pixel(u16 x, u16 y, u8 color) final {}
+  void on_span(u16 y, u16 x1, u16 x2, const u8* src) final {}
 };
 
 template <typename Pixel>
@@ -133,12 +203,13 @@ public:
            b = (uxn.dev[0x0c + i / 2] >> shift) & 0xf;
         palette[i] = color_from_12bit(r, g, b, i);
     }
+    for (i = 0; i < 16; i++) composited[i] = palette[palette_map[i]];
     change(0, 0, w, h);
   }
 
   void repaint() final {
     redraw();
-    on_paint();
+    on_paint(painted, painted_count);
   }
 
   void try_resize(u16 width, u16 height) {
@@ -154,13 +225,18 @@ public:
 
 protected:
   Pixel palette[4], *pixels;
+  // The pixel for each packed layer byte.
+  Pixel composited[16];
   PixelScreen(Uxn& uxn, u16 width, u16 height) : Screen(uxn, width, height) {
     pixels = new Pixel[w * h];
   }
   virtual Pixel color_from_12bit(u8 r, u8 g, u8 b, u8 index) const = 0;
-  virtual void on_paint() = 0;
-  void on_pixel(u16 x, u16 y, u8 color) final {
-    pixels[y*w+x] = palette[color];
+  // Shows `pixels` once `rects` of them have changed.
+  virtual void on_paint(const Rect* rects, u32 count) = 0;
+  void on_span(u16 y, u16 x1, u16 x2, const u8* src) final {
+    static_assert(sizeof(Pixel) == 2 || sizeof(Pixel) == 4, "pixels are 16 or 32 bits");
+    compose_span<sizeof(Pixel)>(reinterpret_cast<u8*>(pixels + y * w + x1), src, x2 - x1,
+                                reinterpret_cast<const u8*>(composited));
   }
 };
 
@@ -212,6 +288,8 @@ public:
   virtual void start(u8 instance);
   void before_dei(u8 d);
   void after_deo(u8 d);
+  void save_state(StateWriter& out) const;
+  bool load_state(StateReader& in);
 
   u8 get_vu(u8 instance) const {
     return channel[instance].sample.env.vol * 255.0f;
@@ -378,8 +456,15 @@ public:
 
   virtual bool init() = 0;
   virtual const u8* load(const char* filename, size_t& out_size) = 0;
+  // Called on reset. If the bytes the last load returned can't be trusted
+  // any more, loads the ROM again into `rom` and `size` and returns true.
+  virtual bool reload(const u8*& rom, size_t& size) { return false; }
 
   void after_deo(u8 d);
+  // Only the open file's name is kept: after load_state, reading it starts
+  // over from the beginning.
+  void save_state(StateWriter& out) const;
+  bool load_state(StateReader& in);
 protected:
   Uxn& uxn;
   char open_filename[UXN_PATH_MAX] = {0};
@@ -408,6 +493,46 @@ public:
   virtual u8 datetime_byte(u8 port) = 0;
 };
 
+////////////////////////////////////////////////////////////
+// RECORDING
+
+/* A recording is everything the host did that the ROM could see, enough
+   to run the session again without the host: devices it wrote to (input,
+   console bytes), values the ROM read from it (the clock, audio playback),
+   resets, and exactly how far each run got, since a vector cut short by
+   the deadline sees the next input at a different point. Each event has
+   the screen frame it happened in.
+
+   File layout, big-endian like Uxn: "UXNREC2\n", u16 width, u16 height,
+   u8 hle (which changes how many instructions vectors take), u8 engine
+   (the one it was recorded on, to tell who disagrees when a replay goes
+   out of sync), then the events. Each is u32 frame, u8 type, u8 port and
+   the rest of its fields: 16 bytes of data for Ports, u16 pc, u32 count
+   and u8 finished for Run, u8 value for Read. Files that read other files
+   only replay against the same files. */
+struct Event {
+  enum Type : u8 {
+    Ports = 0,  // port: a device (0x10, 0x20...), data: its new 16 bytes
+    Run = 1,    // from pc, count instructions; port is 1 if it got to BRK
+    Read = 2,   // DEI of port read data[0]; comes before its Run
+    Reset = 3,  // port is 1 for a soft reset
+  };
+
+  static constexpr u32 HEADER_SIZE = 14, MAX_SIZE = 22;
+
+  u32 frame = 0;
+  Type type = Ports;
+  u8 port = 0;
+  u16 pc = 0;
+  u32 count = 0;
+  u8 data[16] = {0};
+
+  // Both return the bytes used; decode returns 0 if `in` doesn't hold a
+  // whole event.
+  u32 encode(u8* out) const;
+  static u32 decode(const u8* in, u32 size, Event& out);
+};
+
 ////////////////////////////////////////////////////////////
 // VARVARA
 
@@ -417,6 +542,13 @@ public:
   virtual void reset(bool soft);
   virtual void before_dei(u8 d);
   virtual void after_deo(u8 d);
+  void save_devices(StateWriter& out) override;
+  bool load_devices(StateReader& in) override;
+
+  // Logs what comes into the machine from the host to `out`, starting
+  // with the header (see Event), or stops if null. Start between init and
+  // the first vector; vectors then always run through eval_for.
+  void record(StateWriter* out);
 
 protected:
   const char* boot_rom_filename;
@@ -448,6 +580,25 @@ protected:
     base_datetime(time) {}
 
   virtual void on_system_debug(u8 b) {}
+  void before_run(u16 pc) override;
+  void after_run(u16 pc, u32 instructions, bool finished) override;
+  // Input events come once each; the screen and audio call again.
+  bool queues_vector(u8 d) override { return d == 0x10 || d == 0x80 || d == 0x90; }
+
+  // Ports whose DEI reads the host rather than the machine, which
+  // recordings log: the clock and audio playback.
+  static bool reads_host(u8 d) {
+    u8 port = d & 0xf;
+    return (d >= 0xc0 && d <= 0xcf) || (d >= 0x30 && d <= 0x6f && port >= 0x2 && port <= 0x4);
+  }
+
+private:
+  StateWriter* recording = nullptr;
+  // `dev` as the machine last left it, so the host's changes show.
+  u8 recorded_dev[0x100];
+
+  void expansion(u16 addr);
+  void log(const Event& e);
 };
 
 }
@@ -0,0 +1,145 @@
+#include "varvara_pool.hpp"
+#include <new>
+
+namespace uxn {
+
+InstanceArena::InstanceArena(size_t slot_size, u32 slots_per_block)
+: slot_size((slot_size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1)),
+  slots_per_block(slots_per_block) {}
+
+InstanceArena::~InstanceArena() {
+  for (u8* block : blocks) ::operator delete(block);
+}
+
+void* InstanceArena::allocate() {
+  if (free_slots.empty()) {
+    u8* block = static_cast<u8*>(::operator new(slot_size * slots_per_block));
+    blocks.push_back(block);
+    for (u32 i = slots_per_block; i > 0; i--) free_slots.push_back(block + (i - 1) * slot_size);
+  }
+  void* slot = free_slots.back();
+  free_slots.pop_back();
+  return slot;
+}
+
+void InstanceArena::release(void* slot) {
+  free_slots.push_back(slot);
+}
+
+VarvaraPool::VarvaraPool(u32 threads) : arena(sizeof(HeadlessVarvara)) {
+  if (!threads) threads = 1;
+  for (u32 i = 0; i < threads; i++) workers.push_back(new Worker);
+  for (u32 i = 0; i < threads; i++) workers[i]->thread = std::thread(&VarvaraPool::work, this, i);
+}
+
+VarvaraPool::~VarvaraPool() {
+  {
+    std::lock_guard<std::mutex> l(lock);
+    stopping = true;
+  }
+  work_ready.notify_all();
+  for (Worker* w : workers) w->thread.join();
+  for (Worker* w : workers) delete w;
+  for (u32 id = 0; id < instances.size(); id++) if (instances[id].vm) remove(id);
+}
+
+u32 VarvaraPool::add(u16 w, u16 h, const char* root_dir, const char* rom_filename, std::ostream& out) {
+  return place(new (arena.allocate()) HeadlessVarvara(w, h, root_dir, rom_filename, out));
+}
+
+u32 VarvaraPool::add(u16 w, u16 h, const char* root_dir, const u8* rom, u32 rom_size, std::ostream& out) {
+  return place(new (arena.allocate()) HeadlessVarvara(w, h, root_dir, rom, rom_size, out));
+}
+
+u32 VarvaraPool::place(HeadlessVarvara* vm) {
+  u32 id;
+  if (free_ids.empty()) {
+    id = instances.size();
+    instances.emplace_back();
+  } else {
+    id = free_ids.back();
+    free_ids.pop_back();
+  }
+  instances[id] = { vm, next_home++ % threads(), false };
+  live++;
+  return id;
+}
+
+void VarvaraPool::remove(u32 id) {
+  if (id >= instances.size() || !instances[id].vm) return;
+  instances[id].vm->~HeadlessVarvara();
+  arena.release(instances[id].vm);
+  instances[id] = {};
+  free_ids.push_back(id);
+  live--;
+}
+
+void VarvaraPool::run(const std::function<void(u32, HeadlessVarvara&)>& j) {
+  if (!live) return;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    job = &j;
+  }
+  pending = live;
+  for (u32 id = 0; id < instances.size(); id++) {
+    if (!instances[id].vm) continue;
+    Worker& w = *workers[instances[id].home];
+    std::lock_guard<std::mutex> l(w.lock);
+    w.queue.push_back(id);
+  }
+  {
+    std::lock_guard<std::mutex> l(lock);
+    generation++;
+  }
+  work_ready.notify_all();
+  std::unique_lock<std::mutex> l(lock);
+  work_done.wait(l, [&] { return pending == 0; });
+  job = nullptr;
+}
+
+void VarvaraPool::step_all(u32 frames) {
+  run([frames](u32, HeadlessVarvara& vm) { vm.step_frames(frames); });
+}
+
+// A worker takes the oldest instance from its own queue, or else the
+// newest from someone else's, so the two ends rarely meet.
+bool VarvaraPool::next_task(u32 self, u32& id) {
+  for (u32 i = 0; i < workers.size(); i++) {
+    Worker& w = *workers[(self + i) % workers.size()];
+    std::lock_guard<std::mutex> l(w.lock);
+    if (w.queue.empty()) continue;
+    if (i == 0) {
+      id = w.queue.front();
+      w.queue.pop_front();
+    } else {
+      id = w.queue.back();
+      w.queue.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void VarvaraPool::work(u32 self) {
+  u64 seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      work_ready.wait(l, [&] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+    u32 id;
+    while (next_task(self, id)) {
+      Instance& inst = instances[id];
+      if (!inst.vm->initialized && !inst.failed && !inst.vm->init()) inst.failed = true;
+      if (!inst.failed) (*job)(id, *inst.vm);
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> l(lock);
+        work_done.notify_all();
+      }
+    }
+  }
+}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "headless_varvara.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace uxn {
+
+// Fixed-size slots for instances, carved out of large blocks and reused
+// once freed, so adding and removing instances doesn't go back to the
+// allocator for each one (or fault in fresh pages for its 64 KB of ram).
+class InstanceArena {
+public:
+  explicit InstanceArena(size_t slot_size, u32 slots_per_block = 16);
+  ~InstanceArena();
+
+  void* allocate();
+  void release(void* slot);
+
+private:
+  size_t slot_size;
+  u32 slots_per_block;
+  std::vector<u8*> blocks;
+  std::vector<void*> free_slots;
+};
+
+// Many HeadlessVarvara instances, run in parallel by a pool of worker
+// threads. Each instance has a home worker, which runs it whenever it can
+// so its memory stays in that core's cache; workers that run out of their
+// own instances take (steal) queued ones from the others. An instance only
+// ever runs on one thread at a time.
+class VarvaraPool {
+public:
+  explicit VarvaraPool(u32 threads = std::thread::hardware_concurrency());
+  ~VarvaraPool();
+
+  // Instances are initialized (ROM loaded, reset vector run) by the first
+  // run or step_all that includes them. Ids of removed instances are reused.
+  // Console output goes to `out` from whichever worker runs the instance,
+  // so instances running at the same time shouldn't share a stream.
+  u32 add(u16 w, u16 h, const char* root_dir, const char* rom_filename, std::ostream& out = std::cout);
+  u32 add(u16 w, u16 h, const char* root_dir, const u8* rom, u32 rom_size, std::ostream& out = std::cout);
+  void remove(u32 id);
+
+  HeadlessVarvara* operator[](u32 id) { return id < instances.size() ? instances[id].vm : nullptr; }
+  bool failed(u32 id) const { return id < instances.size() && instances[id].failed; }
+  u32 size() const { return live; }
+  u32 threads() const { return workers.size(); }
+
+  // Calls `job` once for every live instance, across the workers, and
+  // returns when all of them are done. Must not be called from a job.
+  void run(const std::function<void(u32 id, HeadlessVarvara& vm)>& job);
+  // Steps every instance `frames` frames.
+  void step_all(u32 frames);
+
+private:
+  struct Instance {
+    HeadlessVarvara* vm = nullptr;
+    u32 home = 0;
+    bool failed = false;
+  };
+
+  struct Worker {
+    std::mutex lock;
+    std::deque<u32> queue;
+    std::thread thread;
+  };
+
+  std::vector<Instance> instances;
+  std::vector<u32> free_ids;
+  u32 live = 0, next_home = 0;
+  InstanceArena arena;
+
+  std::vector<Worker*> workers;
+  std::mutex lock;
+  std::condition_variable work_ready, work_done;
+  const std::function<void(u32, HeadlessVarvara&)>* job = nullptr;
+  u64 generation = 0;
+  std::atomic<u32> pending{0};
+  bool stopping = false;
+
+  u32 place(HeadlessVarvara* vm);
+  bool next_task(u32 self, u32& id);
+  void work(u32 self);
+};
+
+}